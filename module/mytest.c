@@ -12,13 +12,43 @@
 #include <linux/cdev.h>
 #include <linux/poll.h>
 #include <linux/fs.h>
-#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
 #include <linux/syscalls.h>
 #include <linux/stop_machine.h>
+#include <linux/sort.h>
+#include <linux/cpuhotplug.h>
+#include <linux/compat.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/cpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/lz4.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/mempool.h>
+#include <linux/irq_work.h>
+#include <linux/shrinker.h>
+#include <asm/word-at-a-time.h>
 
 #include "mytest.h"
 
+#define CREATE_TRACE_POINTS
+#include "mytest_trace.h"
+
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Sergey Oboguev");
 MODULE_DESCRIPTION("My Test Module");
@@ -27,8 +57,56 @@ typedef enum { TE_1 = 1, TE_2 = 2} TE;
 
 #define NTIMERS  4
 #define NTHREADS 4
-#define NDEVICES 2
 #define DEVICE_NAME "mytest"
+#define MYTEST_STAGE_SIZE (16 * 1024)
+
+/* mytest_append() buffers, two of this size per CPU and device */
+#define MYTEST_PRODUCER_SIZE        (8 * 1024)
+#define MYTEST_PBUF_CLOSED          (1 << 30)
+#define MYTEST_DRAIN_SEGS           16          /* records appended per call when draining */
+
+/* shrinker policies, see shrink_scan() */
+enum
+{
+    MYTEST_SHRINK_OFF,
+    MYTEST_SHRINK_UNREAD,       /* drop data that every reader has read */
+    MYTEST_SHRINK_OLDEST,       /* drop the oldest data, read or not */
+    MYTEST_NSHRINK
+};
+
+/* framed mode: the record index has an entry at least every this many bytes */
+#define MYTEST_INDEX_STRIDE         4096
+
+/* search is split into pieces of this size, handed out to kthreads[] */
+#define MYTEST_SEARCH_PIECE         (64 * 1024)
+#define MYTEST_SEARCH_PIECE_MATCHES 256
+#define MYTEST_SEARCH_MAX_PIECES    512
+#define MYTEST_SEARCH_NQUEUES       (NTHREADS + 1)      /* one per kthread, plus the caller */
+#define MYTEST_SEARCH_NONE          ((u64) -1)
+
+/*
+ * Compressed archive: data is compressed in blocks of this size, stream
+ * aligned. A kthread takes up to MYTEST_ZBATCH blocks of a device per turn,
+ * and each device caches MYTEST_ZCACHE decompressed blocks for readers.
+ * Blocks are archived only when they get within an eighth of maxsize, but at
+ * least MYTEST_ZLEAD_MIN bytes, of leaving a full window.
+ */
+#define MYTEST_ZBLOCK               (64 * 1024)
+#define MYTEST_ZBATCH               16
+#define MYTEST_ZLEAD_MIN            (4 * MYTEST_ZBLOCK)
+#define MYTEST_ZCACHE               4
+#define MYTEST_ZNONE                ((size_t) -1)
+
+/* latency monitor histogram, bucket k counts latencies in [2^(k-1), 2^k) ns */
+#define MYTEST_LAT_BUCKETS          32
+
+/*
+ * Operation latency histogram: each power of two is split into 4 linear
+ * sub-buckets (within 25% of the true value), the last bucket also counts
+ * everything slower than about two minutes.
+ */
+#define MYTEST_OPSTAT_SUB_BITS      2
+#define MYTEST_OPSTAT_BUCKETS       (36 << MYTEST_OPSTAT_SUB_BITS)
 
 /* module parameters (visible in /sys/modules/mytest/paramaters,
    can also have change callbacks hooked) */
@@ -40,6 +118,78 @@ static char* par_s1 = "default_s1";
 module_param_named(s1, par_s1, charp, 0644);
 MODULE_PARM_DESC(s1, "Description of s1");
 
+static unsigned int par_devices = 2;
+module_param_named(devices, par_devices, uint, 0444);
+MODULE_PARM_DESC(devices, "Number of devices to create at load time");
+
+static unsigned int par_max_devices = 64;
+module_param_named(max_devices, par_max_devices, uint, 0444);
+MODULE_PARM_DESC(max_devices, "Maximum number of devices, including ones created later through /sys/class/mytest/create");
+
+static unsigned long par_maxsize = 8 * 1024 * 1024;
+module_param_named(maxsize, par_maxsize, ulong, 0444);
+MODULE_PARM_DESC(maxsize, "Default data size limit of a device, in bytes");
+
+static bool par_ring = false;
+module_param_named(ring, par_ring, bool, 0444);
+MODULE_PARM_DESC(ring, "Create devices in ring mode (keep newest data, overwrite oldest)");
+
+static bool par_staging = false;
+module_param_named(staging, par_staging, bool, 0444);
+MODULE_PARM_DESC(staging, "Create devices with per-CPU write staging enabled");
+
+static bool par_compress = false;
+module_param_named(compress, par_compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Create devices that keep a compressed archive of data leaving the window");
+
+static bool par_framed = false;
+module_param_named(framed, par_framed, bool, 0444);
+MODULE_PARM_DESC(framed, "Create devices in framed mode (each write is a record with a sequence number and timestamp)");
+
+static unsigned long par_compress_budget = 0;
+module_param_named(compress_budget, par_compress_budget, ulong, 0644);
+MODULE_PARM_DESC(compress_budget, "Memory for compressed data that has left the window, per device, in bytes (0: a quarter of maxsize)");
+
+static unsigned int par_stage_flush_bytes = MYTEST_STAGE_SIZE / 2;
+module_param_named(stage_flush_bytes, par_stage_flush_bytes, uint, 0644);
+MODULE_PARM_DESC(stage_flush_bytes, "Fold a per-CPU staging buffer into the device once it holds this many bytes");
+
+static unsigned int par_stage_flush_ms = 10;
+module_param_named(stage_flush_ms, par_stage_flush_ms, uint, 0644);
+MODULE_PARM_DESC(stage_flush_ms, "Fold staged data into the device at most this long after it was written");
+
+static bool par_timer_log = false;
+module_param_named(timer_log, par_timer_log, bool, 0644);
+MODULE_PARM_DESC(timer_log, "Log timer callouts into device 0 through mytest_append()");
+
+static int par_node = NUMA_NO_NODE;
+module_param_named(node, par_node, int, 0444);
+MODULE_PARM_DESC(node, "NUMA node for the data of new devices (-1: any), see also /sys/class/mytest/mytestN/node");
+
+static char* par_shrink = "off";
+module_param_named(shrink, par_shrink, charp, 0444);
+MODULE_PARM_DESC(shrink, "What new devices give up under memory pressure: off, unread (data all readers have read) or oldest, see also /sys/class/mytest/mytestN/shrink");
+
+static unsigned int par_chunk_reserve = 256;
+module_param_named(chunk_reserve, par_chunk_reserve, uint, 0444);
+MODULE_PARM_DESC(chunk_reserve, "Data chunks (pages) held in reserve for writes during memory pressure, shared by all devices");
+
+static bool par_latmon = false;
+module_param_named(latmon, par_latmon, bool, 0444);
+MODULE_PARM_DESC(latmon, "Run the per-CPU scheduling latency monitor (results in debugfs mytest/latency)");
+
+static unsigned int par_latmon_period_us = 1000;
+module_param_named(latmon_period_us, par_latmon_period_us, uint, 0644);
+MODULE_PARM_DESC(latmon_period_us, "Latency monitor wakeup period, in microseconds");
+
+static unsigned int par_latmon_prio = MAX_RT_PRIO - 1;
+module_param_named(latmon_prio, par_latmon_prio, uint, 0444);
+MODULE_PARM_DESC(latmon_prio, "SCHED_FIFO priority of the latency monitor threads");
+
+static bool par_opstats = true;
+module_param_named(opstats, par_opstats, bool, 0644);
+MODULE_PARM_DESC(opstats, "Collect per-device operation statistics (debugfs mytest/mytestN/stats)");
+
 static struct my_timer_list
 {
     struct timer_list   m_tmr;
@@ -51,49 +201,350 @@ static struct my_thread_struct
 {
     struct task_struct*  m_task;
     unsigned int         m_index;
+    int                  m_node;        /* thread runs on this node's CPUs, or NUMA_NO_NODE */
+    char*                m_scratch;     /* search piece buffer, also compression input */
+    void*                m_zwork;       /* LZ4 state, NULL if the thread does not compress */
+    char*                m_zbuf;        /* compression output */
 }
 kthreads[NTHREADS];
 
+/*
+ * Per-CPU latency monitor state. Only the CPU's monitor thread updates it,
+ * readers may see a sample half-accounted, which is fine for statistics.
+ */
+struct mytest_latmon
+{
+    struct task_struct*  task;
+    unsigned int         reset_seq;     /* last latmon_reset_seq acted upon */
+    u64                  samples;
+    u64                  overruns;      /* periods missed entirely */
+    u64                  sum_ns;
+    u64                  max_ns;
+    u64                  hist[MYTEST_LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct mytest_latmon, latmon);
+static atomic_t latmon_reset_seq = ATOMIC_INIT(0);
+static int latmon_hp_state = 0;             /* dynamic cpuhp state, 0 when not registered */
+static struct dentry* mytest_debugfs = NULL;
+
+/* operations accounted in struct mytest_stats */
+enum
+{
+    MYTEST_OP_READ,
+    MYTEST_OP_WRITE,
+    MYTEST_OP_POLL,
+    MYTEST_OP_IOCTL,
+    MYTEST_NOPS
+};
+
+struct mytest_opstat
+{
+    u64                  count;
+    u64                  errors;
+    u64                  bytes;         /* read and write only */
+    u64                  total_ns;
+    u64                  hist[MYTEST_OPSTAT_BUCKETS];
+};
+
+/*
+ * Per-CPU device statistics, updated with this_cpu ops and summed up when read.
+ * lock_wait counts contended acquisitions of wlock and of staging buffer locks.
+ */
+struct mytest_stats
+{
+    struct mytest_opstat op[MYTEST_NOPS];
+    u64                  lock_waits;
+    u64                  lock_wait_ns;
+};
+
+struct mytest_zblock
+{
+    void*                data;          /* NULL if the block was overwritten before it got compressed */
+    u32                  len;           /* MYTEST_ZBLOCK if stored uncompressed */
+};
+
+struct mytest_zcache
+{
+    size_t               block;         /* MYTEST_ZNONE if empty */
+    u64                  used;          /* zclock at last use */
+    char*                data;
+};
+
+struct mytest_zstats
+{
+    u64                  blocks;        /* blocks archived */
+    u64                  bytes_out;     /* their compressed size */
+    u64                  skipped;       /* blocks overwritten before they could be compressed */
+    u64                  dropped;       /* blocks trimmed to stay within zbudget */
+    u64                  cache_hits;
+    u64                  cache_misses;
+};
+
+/* framed mode, a record that starts at offset */
+struct mytest_index_entry
+{
+    u64                  seq;
+    u64                  time_ns;
+    size_t               offset;
+};
+
+/* see IOC_MYTEST_JOIN_GROUP */
+struct mytest_consumer_group
+{
+    struct list_head     link;          /* in mytest_dev->groups */
+    char                 name[MYTEST_GROUP_NAME_MAX];
+    struct mutex         lock;          /* serializes reads and seeks of the members */
+    size_t               cursor;
+    unsigned int         members;       /* files attached, guarded by groups_lock */
+    struct rcu_head      rcu;
+};
+
 struct mytest_dev
 {
-    struct cdev          cdev;
-    bool                 cdev_added;
+    struct kref          ref;           /* held by mytest_devs[] and by each open file */
+    unsigned int         index;         /* slot in mytest_devs[], minor relative to my_cdev_minor */
+    struct cdev*         cdev;
     struct device*       cdev_device;
     dev_t                devno;
-    struct rw_semaphore  rwsem;
-    char*                buffer;
-    size_t               buffer_size;
-    wait_queue_head_t    out_wait_q;
+    size_t               maxsize;       /* max bytes retained, the window size */
+    int                  node;          /* NUMA node for chunks and compression, or NUMA_NO_NODE */
+    atomic64_t           chunks_local;  /* chunks allocated on the node (or the writer's node) */
+    atomic64_t           chunks_remote;
+    int                  shrink;        /* MYTEST_SHRINK_xxx */
+    atomic64_t           evicted;       /* bytes dropped by the shrinker */
+    struct list_head     evict_list;    /* chunks dropped by the shrinker, guarded by wlock */
+    struct work_struct   evict_work;    /* frees them */
+    struct mutex         wlock;         /* serializes writers, readers are lockless */
+    struct page**        pages;         /* data chunks, one page each, see chunk_slot() */
+    size_t               npages;        /* size of pages[] table */
+    size_t               buffer_start;  /* stream offset of the oldest retained byte */
+    size_t               buffer_size;   /* stream offset past the newest byte */
+    bool                 ring;          /* overwrite oldest data instead of refusing writes */
+    bool                 removed;       /* destroyed while still open, see remove_device() */
+    struct page*         hdr_page;      /* struct mytest_mmap_header, mapped at page 0 by mmap */
+    wait_queue_head_t    out_wait_q;    /* writers waiting for POLLOUT, readers have their own */
+    struct list_head     files;         /* open readers, see wake_readers() */
+    spinlock_t           files_lock;
+
+    /* per-CPU write staging, see stage_write() */
+    bool                 staging;
+    struct mytest_stage __percpu* stage;
+    struct delayed_work  stage_work;    /* folds staged data that nobody asked for */
+    atomic64_t           stage_dropped; /* staged bytes that could not be folded in */
+
+    /* compressed archive of data that left the window, see compress_blocks() */
+    bool                 compress;
+    struct mutex         zlock;         /* guards the archive and zcache */
+    struct mytest_zblock* zblocks;      /* block b is in zblocks[b % zcap] */
+    size_t               zcap;
+    size_t               zfirst;        /* oldest archived block */
+    size_t               znext;         /* next block to archive */
+    size_t               zbytes;        /* compressed bytes held */
+    size_t               zbudget;
+    struct mytest_zcache zcache[MYTEST_ZCACHE];
+    u64                  zclock;        /* LRU clock for zcache */
+    struct list_head     zlink;         /* in compress_queue while waiting for a kthread */
+    struct mytest_zstats zstats;
+
+    /* framed mode, see append_record(), all guarded by wlock */
+    bool                 framed;
+    u64                  next_seq;
+    u64                  last_time;     /* timestamp of the newest record */
+    struct mytest_index_entry* rindex;  /* record index, entry i is in rindex[i % rcap] */
+    size_t               rcap;
+    size_t               rfirst;        /* oldest entry, within the window */
+    size_t               rnext;
+
+    /* consumer groups, see trim_work_func() */
+    struct mutex         groups_lock;   /* guards groups and mytest_file->group */
+    struct list_head     groups;
+    unsigned int         ngroups;
+    struct work_struct   trim_work;
+    atomic64_t           trimmed;       /* bytes of chunks freed after all groups read them */
+
+    /* in-kernel producers, see mytest_append() */
+    struct mytest_producer __percpu* producer;
+    struct work_struct   producer_work;
+    atomic64_t           producer_dropped;  /* records refused, or that did not fit into the device */
+
+    struct mytest_stats __percpu* stats;
+    struct mytest_stats* stats_base;    /* totals at last reset, guarded by stats_lock */
+    struct mutex         stats_lock;
+    struct dentry*       debugfs;
+};
+
+/* per-CPU staging buffer of a device */
+struct mytest_stage
+{
+    struct mutex         lock;
+    size_t               used;
+    char*                buf;           /* MYTEST_STAGE_SIZE bytes */
+};
+
+/* per-CPU state of mytest_append(), see there */
+struct mytest_pbuf
+{
+    atomic_t             reserved;      /* bytes handed out, or'ed with MYTEST_PBUF_CLOSED by the drainer */
+    atomic_t             committed;     /* bytes copied in */
+    char*                data;          /* MYTEST_PRODUCER_SIZE bytes */
+};
+
+struct mytest_producer
+{
+    atomic_t             active;        /* bufs[] producers append to */
+    struct mytest_pbuf   bufs[2];
+    struct irq_work      kick;          /* schedules producer_work, safe from NMI */
+    struct mytest_dev*   dev;
+};
+
+/*
+ * Pieces of a search job are spread over per-thread queues. A thread takes
+ * pieces from its own queue first and then steals from the others, so a thread
+ * that got slow pieces (or that is not running at all) does not hold up the job.
+ */
+struct mytest_search_queue
+{
+    atomic_long_t        next;          /* next piece to hand out */
+    long                 limit;         /* one past the last piece of this queue */
+};
+
+struct mytest_search_piece
+{
+    u32                  nmatches;
+    bool                 overflow;      /* ran out of room, stopped at resume */
+    u64                  resume;
+    u64                  last_line;     /* lines mode: start of the last line begun in the piece */
+    u64                  matches[MYTEST_SEARCH_PIECE_MATCHES];
+};
+
+struct mytest_search_job
+{
+    struct list_head     link;          /* in search_jobs while being worked on */
+    atomic_t             users;         /* threads working on the job, incl. the caller */
+    atomic_long_t        unclaimed;     /* pieces not handed out yet */
+    struct mytest_dev*   dev;
+    const char*          pattern;
+    size_t               pattern_len;
+    bool                 lines;
+    size_t               start;         /* matches begin in [start, end) ... */
+    size_t               end;
+    size_t               data_end;      /* ... and finish at or before data_end */
+    long                 npieces;
+    struct mytest_search_piece* pieces;
+    struct mytest_search_queue queues[MYTEST_SEARCH_NQUEUES];
+};
+
+/* per-open state, kept in filp->private_data */
+struct mytest_file
+{
+    struct mytest_dev*   dev;
+    struct file*         filp;
+    atomic64_t           lost;          /* bytes skipped because they were overwritten */
+    struct mytest_consumer_group* group;
+
+    /* wakeup thresholds, see IOC_MYTEST_SET_WAKEUP and reader_ready() */
+    struct list_head     link;          /* in mytest_dev->files, readers only */
+    wait_queue_head_t    wait_q;
+    size_t               wake_bytes;
+    u64                  wake_delay_ns;
+    bool                 wake_exclusive;
+    unsigned long        read_timeout;  /* jiffies a blocking read waits for data, 0 for no limit */
+    u64                  pending_since; /* ktime_get_ns() when unread data was first seen, 0 if none */
+    struct hrtimer       wake_timer;    /* fires at pending_since + wake_delay_ns */
 };
 
 static dev_t my_cdev_devno = 0;
 static unsigned int my_cdev_major = 0;
 static unsigned int my_cdev_minor = 0;
 static struct class* my_cdev_class = NULL;
-static struct mytest_dev mytest_devs[NDEVICES];
-static const size_t my_cdev_maxsize = 8 * 1024 * 1024;
+static DEFINE_MUTEX(mytest_devs_lock);         /* guards mytest_devs[] updates, mytest_append() reads it under RCU */
+static struct mytest_dev** mytest_devs = NULL;  /* par_max_devices slots, NULL when free */
+static int default_node = NUMA_NO_NODE;         /* par_node, once checked by mytest_init() */
+static int default_shrink = MYTEST_SHRINK_OFF;  /* par_shrink, once parsed by mytest_init() */
+
+static DEFINE_SPINLOCK(search_lock);                /* guards search_jobs */
+static LIST_HEAD(search_jobs);
+static DECLARE_WAIT_QUEUE_HEAD(search_wait_q);      /* kthreads[] wait here for jobs and compression */
+static DECLARE_WAIT_QUEUE_HEAD(search_done_q);      /* job owners wait here for helpers to leave */
+
+/*
+ * Data chunks come from chunk_pool, a page mempool with par_chunk_reserve
+ * pages set aside, see alloc_chunk().
+ */
+static mempool_t* chunk_pool = NULL;
+
+static struct
+{
+    atomic64_t           allocs;        /* chunks handed out */
+    atomic64_t           from_buddy;    /* ... of which the page allocator supplied directly */
+    atomic64_t           failed;        /* non-blocking allocations that found nothing */
+    atomic64_t           frees;
+    atomic64_t           in_use;
+    atomic64_t           shrunk;        /* chunks given up to the shrinker */
+}
+chunk_stats;
+
+/* chunk pages freed by trimming are only released once readers are done with them */
+DEFINE_STATIC_SRCU(chunk_srcu);
+
+static DEFINE_SPINLOCK(compress_lock);              /* guards compress_queue */
+static LIST_HEAD(compress_queue);                   /* devices with blocks to archive */
 
 static int my_cdev_open(struct inode *, struct file *);
 static int my_cdev_release(struct inode *, struct file *);
-static ssize_t my_cdev_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t my_cdev_write(struct file *, const char __user *, size_t, loff_t *);
+static ssize_t my_cdev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t my_cdev_write_iter(struct kiocb *, struct iov_iter *);
 static loff_t my_cdev_llseek(struct file *, loff_t, int);
 static unsigned int my_cdev_poll(struct file *, struct poll_table_struct *);
 static long my_cdev_unlocked_ioctl(struct file *, unsigned int, unsigned long);
 static long my_cdev_compat_ioctl(struct file *, unsigned int, unsigned long);
+static int my_cdev_mmap(struct file *, struct vm_area_struct *);
+static int my_vm_fault(struct vm_fault *);
 
 static struct file_operations my_cdev_ops =
 {
     .owner           =  THIS_MODULE,
     .open            =  my_cdev_open,
     .release         =  my_cdev_release,
-    .read            =  my_cdev_read,
-    .write           =  my_cdev_write,
+    .read_iter       =  my_cdev_read_iter,
+    .write_iter      =  my_cdev_write_iter,
+    .splice_read     =  generic_file_splice_read,
+    .splice_write    =  iter_file_splice_write,
     .llseek          =  my_cdev_llseek,
     .poll            =  my_cdev_poll,
     .unlocked_ioctl  =  my_cdev_unlocked_ioctl,
     .compat_ioctl    =  my_cdev_compat_ioctl,
+    .mmap            =  my_cdev_mmap,
+};
+
+static const struct vm_operations_struct my_vm_ops =
+{
+    .fault           =  my_vm_fault,
+};
+
+static ssize_t create_store(struct class* cls, struct class_attribute* attr, const char* buf, size_t count);
+static ssize_t destroy_store(struct class* cls, struct class_attribute* attr, const char* buf, size_t count);
+static ssize_t maxsize_show(struct device* d, struct device_attribute* attr, char* buf);
+static ssize_t node_show(struct device* d, struct device_attribute* attr, char* buf);
+static ssize_t node_store(struct device* d, struct device_attribute* attr, const char* buf, size_t count);
+static ssize_t shrink_show(struct device* d, struct device_attribute* attr, char* buf);
+static ssize_t shrink_store(struct device* d, struct device_attribute* attr, const char* buf, size_t count);
+
+static CLASS_ATTR_WO(create);
+static CLASS_ATTR_WO(destroy);
+static DEVICE_ATTR_RO(maxsize);
+static DEVICE_ATTR_RW(node);
+static DEVICE_ATTR_RW(shrink);
+
+static struct attribute* mytest_dev_attrs[] =
+{
+    &dev_attr_maxsize.attr,
+    &dev_attr_node.attr,
+    &dev_attr_shrink.attr,
+    NULL,
 };
+ATTRIBUTE_GROUPS(mytest_dev);
 
 static void my_smp_function(void* arg);
 static int my_stop_machine_function(void* arg);
@@ -101,7 +552,232 @@ static void release_all(void);
 static void my_callout(unsigned long arg);
 static int my_thread_func(void* data);
 static void display_prio(struct my_thread_struct*);
+static void latmon_start(void);
+static int latmon_cpu_online(unsigned int cpu);
+static int latmon_cpu_offline(unsigned int cpu);
+static int latmon_thread_func(void* data);
+static int stats_open(struct inode* inode, struct file* filp);
+static int stats_show(struct seq_file* m, void* v);
+static ssize_t stats_write(struct file* filp, const char __user* buf, size_t count, loff_t* ppos);
+static void sum_stats(struct mytest_dev* dev, struct mytest_stats* sum);
+static int lock_timed(struct mytest_dev* dev, struct mutex* lock, bool nowait);
+static ssize_t do_read_iter(struct kiocb* iocb, struct iov_iter* to);
+static ssize_t do_write_iter(struct kiocb* iocb, struct iov_iter* from);
+static unsigned int do_poll(struct file* filp, struct poll_table_struct* wait);
+static long do_ioctl(struct file* filp, unsigned int cmd, unsigned long arg);
+static bool reader_ready(struct mytest_file* mf, size_t size, u64 now);
+static void wake_readers(struct mytest_dev* dev);
+static enum hrtimer_restart wake_timer_func(struct hrtimer* timer);
+static int set_wakeup(struct mytest_file* mf, const struct mytest_wakeup __user* arg);
+static int set_compress(struct mytest_dev* dev, bool compress);
+static void free_archive(struct mytest_dev* dev);
+static void queue_compress(struct mytest_dev* dev);
+static struct mytest_dev* get_compress_dev(int node);
+static bool compress_blocks(struct mytest_dev* dev, struct my_thread_struct* t);
+static ssize_t read_archive(struct mytest_dev* dev, struct iov_iter* to, size_t* offset, size_t count,
+                            atomic64_t* lost, bool nowait);
+static const char* zcache_get(struct mytest_dev* dev, size_t b, const struct mytest_zblock* zb);
+static size_t retained_start(struct mytest_dev* dev);
+static size_t archive_limit(struct mytest_dev* dev, size_t size);
+static void drop_archive_block(struct mytest_dev* dev);
+static struct page* alloc_chunk(struct mytest_dev* dev, gfp_t gfp);
+static bool valid_node(int node);
+static int thread_node(unsigned int k);
+static void free_chunk(struct page* page);
+static void* chunk_pool_alloc(gfp_t gfp, void* data);
+static void chunk_pool_free(void* element, void* data);
+static int chunks_open(struct inode* inode, struct file* filp);
+static int chunks_show(struct seq_file* m, void* v);
+static ssize_t read_data(struct kiocb* iocb, struct iov_iter* to);
+static ssize_t read_window(struct kiocb* iocb, struct iov_iter* to);
+static size_t file_pos(struct mytest_file* mf);
+static struct mytest_consumer_group* lock_group(struct mytest_file* mf, bool nowait);
+static struct mytest_consumer_group* find_group(struct mytest_dev* dev, const char* name);
+static int copy_group_from_user(struct mytest_group* req, const struct mytest_group __user* ugroup);
+static int join_group(struct mytest_file* mf, struct mytest_group __user* ugroup);
+static int leave_group(struct mytest_file* mf);
+static int delete_group(struct mytest_dev* dev, const struct mytest_group __user* ugroup);
+static void trim_work_func(struct work_struct* work);
+static void free_groups(struct mytest_dev* dev);
+static int groups_open(struct inode* inode, struct file* filp);
+static int groups_show(struct seq_file* m, void* v);
+static int alloc_producers(struct mytest_dev* dev);
+static void free_producers(struct mytest_dev* dev);
+static void producer_kick(struct irq_work* work);
+static void producer_work_func(struct work_struct* work);
+static void drain_pbuf(struct mytest_dev* dev, struct mytest_pbuf* b);
+static int set_framed(struct mytest_dev* dev, bool framed);
+static ssize_t append_record(struct mytest_dev* dev, struct iov_iter* from, bool nowait);
+static size_t store_iter(struct mytest_dev* dev, size_t offset, struct iov_iter* from, size_t count, bool nowait, ssize_t* error);
+static size_t skip_records(struct mytest_dev* dev, size_t offset, size_t want);
+static size_t whole_records(struct mytest_dev* dev, size_t offset, size_t len);
+static void prune_index(struct mytest_dev* dev);
+static size_t find_record(struct mytest_dev* dev, u32 whence, u64 value, u64* seq);
+static long do_seek_record(struct file* filp, struct mytest_seek __user* useek);
+static int parse_shrink(const char* buf);
+static unsigned long shrink_count(struct shrinker* s, struct shrink_control* sc);
+static unsigned long shrink_scan(struct shrinker* s, struct shrink_control* sc);
+static size_t shrink_limit(struct mytest_dev* dev);
+static unsigned long shrink_device(struct mytest_dev* dev, unsigned long nr);
+static void evict_work_func(struct work_struct* work);
+
+static struct shrinker mytest_shrinker =
+{
+    .count_objects   =  shrink_count,
+    .scan_objects    =  shrink_scan,
+    .seeks           =  DEFAULT_SEEKS,
+};
+static bool mytest_shrinker_registered = false;
+
+static const struct file_operations stats_fops =
+{
+    .owner           =  THIS_MODULE,
+    .open            =  stats_open,
+    .read            =  seq_read,
+    .write           =  stats_write,
+    .llseek          =  seq_lseek,
+    .release         =  single_release,
+};
+
+static const struct file_operations groups_fops =
+{
+    .owner           =  THIS_MODULE,
+    .open            =  groups_open,
+    .read            =  seq_read,
+    .llseek          =  seq_lseek,
+    .release         =  single_release,
+};
+
+static const struct file_operations chunks_fops =
+{
+    .owner           =  THIS_MODULE,
+    .open            =  chunks_open,
+    .read            =  seq_read,
+    .llseek          =  seq_lseek,
+    .release         =  single_release,
+};
+
+static int latmon_open(struct inode* inode, struct file* filp);
+static int latmon_show(struct seq_file* m, void* v);
+static ssize_t latmon_write(struct file* filp, const char __user* buf, size_t count, loff_t* ppos);
+
+static const struct file_operations latmon_fops =
+{
+    .owner           =  THIS_MODULE,
+    .open            =  latmon_open,
+    .read            =  seq_read,
+    .write           =  latmon_write,
+    .llseek          =  seq_lseek,
+    .release         =  single_release,
+};
 static void call_fs_sync(void);
+static int create_device(int index, size_t maxsize);
+static int destroy_device(unsigned int index);
+static void remove_device(struct mytest_dev* dev);
+static void mytest_dev_release(struct kref* ref);
+static void free_chunks(struct mytest_dev* dev);
+static int set_ring_mode(struct mytest_dev* dev, bool ring);
+static int set_staging(struct mytest_dev* dev, bool staging);
+static ssize_t append_iter(struct mytest_dev* dev, struct iov_iter* from, bool nowait, bool whole);
+static ssize_t stage_write(struct mytest_dev* dev, struct iov_iter* from, bool nowait);
+static int fold_stage(struct mytest_dev* dev, struct mytest_stage* st, bool nowait);
+static void flush_stages(struct mytest_dev* dev, bool nowait);
+static void stage_work_func(struct work_struct* work);
+static void free_stages(struct mytest_dev* dev);
+static size_t copy_chunks_to_iter(struct mytest_dev* dev, struct iov_iter* to, size_t offset, size_t count);
+static long do_batch(struct file* filp, struct mytest_batch __user* ubatch);
+static long do_search(struct file* filp, struct mytest_search __user* usearch);
+static long do_ipi_bench(struct mytest_ipi_bench __user* ubench);
+static long ipi_bench_row(void* arg);
+static u64 ipi_median(u64* samples, unsigned int n);
+static int cmp_u64(const void* a, const void* b);
+static struct mytest_search_job* get_search_job(void);
+static void put_search_job(struct mytest_search_job* job);
+static void run_search(struct mytest_search_job* job, unsigned int self, char* scratch);
+static void search_piece(struct mytest_search_job* job, long k, char* scratch);
+static void copy_chunks_to_buf(struct mytest_dev* dev, char* buf, size_t offset, size_t count);
+static const char* scan_memchr(const char* p, int c, size_t n);
+static const char* scan_memmem(const char* p, size_t n, const char* pat, size_t plen);
+static int do_batch_entry(struct file* filp, const struct mytest_batch_entry* ent);
+
+static inline struct mytest_mmap_header* mmap_header(struct mytest_dev* dev)
+{
+    return (struct mytest_mmap_header*) page_address(dev->hdr_page);
+}
+
+/*
+ * Data is addressed by stream offset, which only ever grows. The device retains
+ * the window [buffer_start, buffer_size) of at most dev->maxsize bytes, and
+ * the chunk holding a given offset is picked modulo the table size. The table
+ * has one spare slot, so a full window never has its first and last byte
+ * competing for the same chunk.
+ */
+static inline struct page** chunk_slot(struct mytest_dev* dev, size_t offset)
+{
+    return &dev->pages[(offset >> PAGE_SHIFT) % dev->npages];
+}
+
+/*
+ * Caller must not be put to sleep: RWF_NOWAIT/AIO submission (IOCB_NOWAIT)
+ * or a file opened with O_NONBLOCK
+ */
+static inline bool io_nowait(struct kiocb* iocb)
+{
+    return (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+/*
+ * Operation statistics cost a local_clock() pair and a few this_cpu ops
+ * per call, 0 means statistics are off.
+ */
+static inline u64 opstat_begin(void)
+{
+    return READ_ONCE(par_opstats) ? local_clock() : 0;
+}
+
+static inline unsigned int opstat_bucket(u64 ns)
+{
+    unsigned int e;
+
+    if (ns < (1 << MYTEST_OPSTAT_SUB_BITS))
+        return ns;
+
+    e = fls64(ns) - 1;
+    return min(((e - MYTEST_OPSTAT_SUB_BITS + 1) << MYTEST_OPSTAT_SUB_BITS) +
+               (unsigned int) ((ns >> (e - MYTEST_OPSTAT_SUB_BITS)) & ((1 << MYTEST_OPSTAT_SUB_BITS) - 1)),
+               (unsigned int) MYTEST_OPSTAT_BUCKETS - 1);
+}
+
+/* smallest value falling into the bucket */
+static inline u64 opstat_bucket_floor(unsigned int k)
+{
+    unsigned int e;
+
+    if (k < (1 << MYTEST_OPSTAT_SUB_BITS))
+        return k;
+
+    e = (k >> MYTEST_OPSTAT_SUB_BITS) + MYTEST_OPSTAT_SUB_BITS - 1;
+    return (u64) ((1 << MYTEST_OPSTAT_SUB_BITS) + (k & ((1 << MYTEST_OPSTAT_SUB_BITS) - 1))) << (e - MYTEST_OPSTAT_SUB_BITS);
+}
+
+static inline void opstat_end(struct mytest_dev* dev, int op, u64 t0, ssize_t ret)
+{
+    s64 ns;
+
+    if (t0 == 0)
+        return;
+
+    /* local_clock() is not synchronized across CPUs, if we migrated it can go back */
+    ns = max_t(s64, local_clock() - t0, 0);
+
+    this_cpu_inc(dev->stats->op[op].count);
+    this_cpu_add(dev->stats->op[op].total_ns, ns);
+    this_cpu_inc(dev->stats->op[op].hist[opstat_bucket(ns)]);
+    if (ret < 0)
+        this_cpu_inc(dev->stats->op[op].errors);
+    else if (op == MYTEST_OP_READ || op == MYTEST_OP_WRITE)
+        this_cpu_add(dev->stats->op[op].bytes, ret);
+}
 
 static int mytest_init(void)
 {
@@ -133,35 +809,6 @@ static int mytest_init(void)
     printk(KERN_ALERT "mytest: parameter a1=%u\n", par_a1);
     printk(KERN_ALERT "mytest: parameter s1=%s\n", par_s1);
 
-    /*
-     *
-     */
-    preempt_disable();
-    printk(KERN_ALERT "mytest: issuing MP calls from CPU %d ...\n", smp_processor_id());
-    on_each_cpu_mask(cpu_online_mask, my_smp_function, "test message", true);
-    preempt_enable();
-    printk(KERN_ALERT "mytest: MP calls completed\n");
-
-    /*
-     * my_stop_machine_function() will be called only on one CPU, with irqs disabled,
-     * but other cpus will be blocked at the time for the duration of the call
-     */
-    printk(KERN_ALERT "mytest: issuing stop-machine calls from CPU %d ...\n", smp_processor_id());
-    if (stop_machine(my_stop_machine_function, "my stop-machine-message", NULL))
-        printk(KERN_ALERT "mytest: stop-machine calls failed\n");
-    else
-        printk(KERN_ALERT "mytest: stop-machine calls completed\n");
-
-    for (k = 0;  k < NDEVICES;  k++)
-    {
-        struct mytest_dev* dev = &mytest_devs[k];
-        dev->cdev_added = false;
-        dev->cdev_device = NULL;
-        dev->buffer = NULL;
-        dev->buffer_size = 0;
-        init_waitqueue_head(&dev->out_wait_q);
-    }
-
     for (k = 0;  k < NTIMERS;  k++)
     {
         struct my_timer_list* t = &tmr[k];
@@ -177,19 +824,82 @@ static int mytest_init(void)
         struct my_thread_struct* t = &kthreads[k];
         t->m_task = NULL;
         t->m_index = k;
+        t->m_node = thread_node(k);
+        t->m_scratch = NULL;
     }
 
+    /*
+     * On NUMA machines the threads are spread over the nodes and kept there,
+     * so that compression of a device with a node runs next to its data.
+     */
     for (k = 0;  k < NTHREADS;  k++)
     {
         struct my_thread_struct* t = &kthreads[k];
-        struct task_struct* task = kthread_run(my_thread_func, t, "mytest/%d", k);
+        struct task_struct* task = kthread_create_on_node(my_thread_func, t, t->m_node, "mytest/%d", k);
         if (IS_ERR(task))
+        {
             printk(KERN_ALERT "mytest: Failed to create thread.\n");
-        else
-            t->m_task = task;
+            continue;
+        }
+        if (t->m_node != NUMA_NO_NODE)
+            set_cpus_allowed_ptr(task, cpumask_of_node(t->m_node));
+        t->m_task = task;
+        wake_up_process(task);
+    }
+
+    /* debugfs is optional, everything under it is for diagnostics only */
+    mytest_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+    if (IS_ERR_OR_NULL(mytest_debugfs))
+        mytest_debugfs = NULL;
+
+    chunk_pool = mempool_create(par_chunk_reserve, chunk_pool_alloc, chunk_pool_free, NULL);
+    if (chunk_pool == NULL)
+    {
+        printk(KERN_ALERT "mytest: Unable to allocate chunk reserve.\n");
+        release_all();
+        return -ENOMEM;
+    }
+    /* filling the reserve does not count */
+    atomic64_set(&chunk_stats.from_buddy, 0);
+    if (mytest_debugfs)
+        debugfs_create_file("chunks", 0444, mytest_debugfs, NULL, &chunks_fops);
+
+    if (par_latmon)
+        latmon_start();
+
+    if (par_max_devices < par_devices)
+        par_max_devices = par_devices;
+
+    if (valid_node(par_node))
+        default_node = par_node;
+    else
+        printk(KERN_ALERT "mytest: node %d has no memory, ignored.\n", par_node);
+
+    default_shrink = parse_shrink(par_shrink);
+    if (default_shrink < 0)
+    {
+        printk(KERN_ALERT "mytest: unknown shrink policy %s, using off.\n", par_shrink);
+        default_shrink = MYTEST_SHRINK_OFF;
+    }
+
+    mytest_devs = kcalloc(par_max_devices, sizeof(struct mytest_dev*), GFP_KERNEL);
+    if (mytest_devs == NULL)
+    {
+        printk(KERN_ALERT "mytest: Unable to allocate device table.\n");
+        release_all();
+        return -ENOMEM;
     }
 
-    error = alloc_chrdev_region(&my_cdev_devno, 0, NDEVICES, DEVICE_NAME);
+    error = register_shrinker(&mytest_shrinker);
+    if (error)
+    {
+        printk(KERN_ALERT "mytest: Unable to register shrinker.\n");
+        release_all();
+        return error;
+    }
+    mytest_shrinker_registered = true;
+
+    error = alloc_chrdev_region(&my_cdev_devno, 0, par_max_devices, DEVICE_NAME);
     if (error)  
     {
         my_cdev_devno = 0;
@@ -209,40 +919,28 @@ static int mytest_init(void)
         release_all();
         return error;
     }
+    my_cdev_class->dev_groups = mytest_dev_groups;
 
-    for (k = 0;  k < NDEVICES;  k++)
+    for (k = 0;  k < par_devices;  k++)
     {
-        struct mytest_dev* dev = &mytest_devs[k];
-        struct cdev* cdev = &dev->cdev;
-
-        dev->devno = MKDEV(my_cdev_major, my_cdev_minor + k);
-        init_rwsem(& dev->rwsem);
-
-        cdev_init(cdev, &my_cdev_ops);
-        cdev->owner = THIS_MODULE;
-        init_waitqueue_head(&dev->out_wait_q);
-
-        error = cdev_add(cdev, dev->devno, 1);
-        if (error)
+        error = create_device(k, par_maxsize);
+        if (error < 0)
         {
-            printk(KERN_ALERT "mytest: Unable to add device.\n");
+            printk(KERN_ALERT "mytest: Unable to create device %d.\n", k);
             release_all();
             return error;
         }
-        else
-        {
-            dev->cdev_added = true;
-        }
+    }
 
-        dev->cdev_device = device_create(my_cdev_class, NULL, dev->devno, NULL, DEVICE_NAME "%d", k);
-        if (IS_ERR(dev->cdev_device))
-        {
-            error = PTR_ERR(dev->cdev_device);
-            dev->cdev_device = NULL;
-            printk(KERN_ALERT "mytest: Unable to create device.\n");
-            release_all();
-            return error;
-        }
+    /* after the initial devices, so that these cannot race with their creation */
+    error = class_create_file(my_cdev_class, &class_attr_create);
+    if (error == 0)
+        error = class_create_file(my_cdev_class, &class_attr_destroy);
+    if (error)
+    {
+        printk(KERN_ALERT "mytest: Unable to create class attributes.\n");
+        release_all();
+        return error;
     }
 
     printk(KERN_ALERT "mytest: Finished loading.\n");
@@ -260,23 +958,23 @@ module_init(mytest_init);
 module_exit(mytest_exit);
 
 /*
- * Executed on each CPU with IRQs disabled.
- * On CPUs other than invoking on_each_cpu_mask(), executed in IPI context.
- * On CPUs invoking on_each_cpu_mask(), executed in non-IRQ context.
+ * Target of the cross calls timed by IOC_MYTEST_IPI_BENCH, does nothing,
+ * so that only the cost of getting there and back is measured.
+ *
+ * Executed with IRQs disabled.
+ * On CPUs other than the calling one, executed in IPI context.
+ * On the calling CPU (on_each_cpu_mask() including self), executed in non-IRQ context.
  */
 static void my_smp_function(void* arg)
 {
-    printk(KERN_ALERT "mytest: MP call on cpu %d: %s (in_interrupt=%lx, in_irq=%lx, preempt_count=%x, irqs_disabled=%x)\n", 
-           smp_processor_id(), (const char*) arg, in_interrupt(), in_irq(), preempt_count(), irqs_disabled());
 }
 
 /*
- * Executed on one CPU with IRQs disabled.
+ * Executed on one CPU with IRQs disabled,
+ * while all other CPUs spin with IRQs disabled too.
  */
 static int my_stop_machine_function(void* arg)
 {
-    printk(KERN_ALERT "mytest: Stop Machine call on cpu %d: %s (in_interrupt=%lx, in_irq=%lx, preempt_count=%x, irqs_disabled=%x)\n", 
-           smp_processor_id(), (const char*) arg, in_interrupt(), in_irq(), preempt_count(), irqs_disabled());
     return 0;
 }
 
@@ -310,37 +1008,31 @@ static void release_all(void)
      * synchronize_sched to disable acquisiton of references (such as opening 
      * devices) while module is being unloaded.
      */
-    for (k = 0;  k < NDEVICES;  k++)
+    if (my_cdev_class)
     {
-        struct mytest_dev* dev = &mytest_devs[k];
-        struct cdev* cdev = &dev->cdev;
+        /* waits for create/destroy requests in progress */
+        class_remove_file(my_cdev_class, &class_attr_create);
+        class_remove_file(my_cdev_class, &class_attr_destroy);
+    }
 
-        if (dev->cdev_device)
-        {
-            device_destroy(my_cdev_class, dev->devno);
-            dev->cdev_device = NULL;
-        }
+    /* waits for scans in progress */
+    if (mytest_shrinker_registered)
+    {
+        unregister_shrinker(&mytest_shrinker);
+        mytest_shrinker_registered = false;
+    }
 
-        if (dev->cdev_added)
-        {
-            cdev_del(cdev);
-            dev->cdev_added = false;
-        }
+    if (mytest_devs)
+    {
+        struct mytest_dev** devs = mytest_devs;
 
-        /*
-         * This wake up does not have any effect during normal module unloading,
-         * since by that time all references to the device should be gone. 
-         * It can be of some use in case of force-unloading (all bets are off then, 
-         * of course) or if this code snippet is used in other contexts.
-         */
-        wake_up_all(&dev->out_wait_q);
+        for (k = 0;  k < par_max_devices;  k++)
+            destroy_device(k);
 
-        if (dev->buffer)
-        {
-            kfree(dev->buffer);
-            dev->buffer = NULL;
-        }
-        dev->buffer_size = 0;
+        /* timer callouts may still be looking at it, see mytest_append() */
+        rcu_assign_pointer(mytest_devs, NULL);
+        synchronize_rcu();
+        kfree(devs);
     }
 
     if (my_cdev_class)
@@ -351,7 +1043,7 @@ static void release_all(void)
 
     if (my_cdev_devno)
     {
-        unregister_chrdev_region(my_cdev_devno, NDEVICES);
+        unregister_chrdev_region(my_cdev_devno, par_max_devices);
         my_cdev_devno = 0;
     }
 
@@ -370,347 +1062,4443 @@ static void release_all(void)
             kthread_stop(t->m_task);
     }
     printk(KERN_ALERT "mytest: Stopped threads\n");
-}
 
-static void my_callout(unsigned long arg)
-{
-    struct my_timer_list* t;
+    /* devices still waiting for compression hold references */
+    {
+        struct mytest_dev* dev;
+        while ((dev = get_compress_dev(NUMA_NO_NODE)) != NULL)
+            kref_put(&dev->ref, mytest_dev_release);
+    }
 
-    BUILD_BUG_ON(sizeof(unsigned long) < sizeof(void*));
+    /* all devices are gone, and their chunks back */
+    if (chunk_pool)
+    {
+        mempool_destroy(chunk_pool);
+        chunk_pool = NULL;
+    }
 
-    t = (struct my_timer_list*) arg;
-    printk(KERN_ALERT "mytest: timer %d (cpu %d, in_interrupt=%lx, in_irq=%lx, in_softirq=%lx, in_serving_softirq=%lx, preempt_count=%x)\n", 
-           t->m_index, smp_processor_id(), in_interrupt(), in_irq(), in_softirq(), in_serving_softirq(), preempt_count());
-    mod_timer(& t->m_tmr, jiffies + msecs_to_jiffies(8 * 1000));
+    debugfs_remove_recursive(mytest_debugfs);
+    mytest_debugfs = NULL;
+
+    /* stops the latency monitor threads on all online CPUs */
+    if (latmon_hp_state > 0)
+    {
+        cpuhp_remove_state(latmon_hp_state);
+        latmon_hp_state = 0;
+    }
 }
 
-static int my_thread_func(void* data)
+/*
+ * Create a device in slot @index, or in the first free slot if @index is
+ * negative, retaining up to @maxsize bytes. Returns the slot used or -errno.
+ */
+static int create_device(int index, size_t maxsize)
 {
-    struct my_thread_struct* t = (struct my_thread_struct*) data;
-    // int old_nice;
-    // int new_nice;
+    struct mytest_dev* dev;
+    int error;
 
-    printk(KERN_ALERT "mytest: thread %d\n", t->m_index);
+    if (maxsize < PAGE_SIZE)
+        return -EINVAL;
+
+    mutex_lock(&mytest_devs_lock);
+
+    if (index < 0)
+    {
+        for (index = 0;  index < par_max_devices;  index++)
+        {
+            if (mytest_devs[index] == NULL)
+                break;
+        }
+    }
+
+    if (index >= par_max_devices)
+    {
+        mutex_unlock(&mytest_devs_lock);
+        return -ENOSPC;
+    }
+
+    if (mytest_devs[index])
+    {
+        mutex_unlock(&mytest_devs_lock);
+        return -EEXIST;
+    }
+
+    dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, default_node);
+    if (dev == NULL)
+    {
+        mutex_unlock(&mytest_devs_lock);
+        return -ENOMEM;
+    }
+
+    kref_init(&dev->ref);
+    dev->index = index;
+    dev->devno = MKDEV(my_cdev_major, my_cdev_minor + index);
+    dev->maxsize = maxsize;
+    dev->node = default_node;
+    atomic64_set(&dev->chunks_local, 0);
+    atomic64_set(&dev->chunks_remote, 0);
+    dev->shrink = default_shrink;
+    atomic64_set(&dev->evicted, 0);
+    INIT_LIST_HEAD(&dev->evict_list);
+    INIT_WORK(&dev->evict_work, evict_work_func);
+    mutex_init(& dev->wlock);
+    init_waitqueue_head(&dev->out_wait_q);
+    INIT_LIST_HEAD(&dev->files);
+    spin_lock_init(&dev->files_lock);
+    INIT_DELAYED_WORK(&dev->stage_work, stage_work_func);
+    atomic64_set(&dev->stage_dropped, 0);
+    mutex_init(&dev->zlock);
+    INIT_LIST_HEAD(&dev->zlink);
+    mutex_init(&dev->groups_lock);
+    INIT_LIST_HEAD(&dev->groups);
+    INIT_WORK(&dev->trim_work, trim_work_func);
+    INIT_WORK(&dev->producer_work, producer_work_func);
+    atomic64_set(&dev->producer_dropped, 0);
+    atomic64_set(&dev->trimmed, 0);
+    mutex_init(&dev->stats_lock);
+
+    dev->stats = alloc_percpu(struct mytest_stats);
+    dev->stats_base = kzalloc(sizeof(struct mytest_stats), GFP_KERNEL);
+    if (dev->stats == NULL || dev->stats_base == NULL)
+    {
+        printk(KERN_ALERT "mytest: Unable to allocate statistics.\n");
+        error = -ENOMEM;
+        goto fail;
+    }
+
+    /*
+     * Chunk table covers the whole of maxsize, so appends never have to move
+     * existing data. Chunks themselves are allocated on demand, or all at once
+     * when the device is switched into ring mode.
+     */
+    dev->npages = DIV_ROUND_UP(dev->maxsize, PAGE_SIZE) + 1;
+    dev->pages = kzalloc_node(dev->npages * sizeof(struct page*), GFP_KERNEL, dev->node);
+    if (dev->pages == NULL)
+    {
+        dev->npages = 0;
+        printk(KERN_ALERT "mytest: Unable to allocate chunk table.\n");
+        error = -ENOMEM;
+        goto fail;
+    }
+
+    dev->hdr_page = alloc_pages_node(dev->node, GFP_KERNEL | __GFP_ZERO, 0);
+    if (dev->hdr_page == NULL)
+    {
+        printk(KERN_ALERT "mytest: Unable to allocate mmap header.\n");
+        error = -ENOMEM;
+        goto fail;
+    }
+    mmap_header(dev)->data_capacity = dev->maxsize;
+    mmap_header(dev)->data_pages = dev->npages;
+
+    error = alloc_producers(dev);
+    if (error)
+    {
+        printk(KERN_ALERT "mytest: Unable to allocate producer buffers.\n");
+        goto fail;
+    }
+
+    if (par_ring)
+    {
+        error = set_ring_mode(dev, true);
+        if (error)
+        {
+            printk(KERN_ALERT "mytest: Unable to preallocate ring buffer.\n");
+            goto fail;
+        }
+    }
+
+    if (par_staging)
+    {
+        error = set_staging(dev, true);
+        if (error)
+        {
+            printk(KERN_ALERT "mytest: Unable to allocate staging buffers.\n");
+            goto fail;
+        }
+    }
+
+    if (par_compress)
+    {
+        error = set_compress(dev, true);
+        if (error)
+        {
+            printk(KERN_ALERT "mytest: Unable to allocate compressed archive.\n");
+            goto fail;
+        }
+    }
+
+    if (par_framed)
+    {
+        error = set_framed(dev, true);
+        if (error)
+        {
+            printk(KERN_ALERT "mytest: Unable to set up framed mode (it does not go with staging or compress).\n");
+            goto fail;
+        }
+    }
+
+    /*
+     * The cdev is allocated separately rather than embedded, since an open
+     * file keeps a reference to it that can outlive a destroyed device.
+     */
+    dev->cdev = cdev_alloc();
+    if (dev->cdev == NULL)
+    {
+        printk(KERN_ALERT "mytest: Unable to allocate device.\n");
+        error = -ENOMEM;
+        goto fail;
+    }
+    dev->cdev->ops = &my_cdev_ops;
+    dev->cdev->owner = THIS_MODULE;
+
+    /* visible to open and mytest_append() from here on */
+    rcu_assign_pointer(mytest_devs[index], dev);
+
+    error = cdev_add(dev->cdev, dev->devno, 1);
+    if (error)
+    {
+        kobject_put(&dev->cdev->kobj);
+        dev->cdev = NULL;
+        printk(KERN_ALERT "mytest: Unable to add device.\n");
+        goto fail;
+    }
+
+    dev->cdev_device = device_create(my_cdev_class, NULL, dev->devno, dev, DEVICE_NAME "%d", index);
+    if (IS_ERR(dev->cdev_device))
+    {
+        error = PTR_ERR(dev->cdev_device);
+        dev->cdev_device = NULL;
+        printk(KERN_ALERT "mytest: Unable to create device.\n");
+        goto fail;
+    }
+
+    if (mytest_debugfs)
+    {
+        dev->debugfs = debugfs_create_dir(dev_name(dev->cdev_device), mytest_debugfs);
+        if (IS_ERR_OR_NULL(dev->debugfs))
+            dev->debugfs = NULL;
+        else
+        {
+            debugfs_create_file("stats", 0644, dev->debugfs, dev, &stats_fops);
+            debugfs_create_file("groups", 0444, dev->debugfs, dev, &groups_fops);
+        }
+    }
+
+    mutex_unlock(&mytest_devs_lock);
+
+    return index;
+
+fail:
+    mytest_devs[index] = NULL;
+    mutex_unlock(&mytest_devs_lock);
+    remove_device(dev);
+    return error;
+}
+
+/*
+ * Remove the device in slot @index. Files that have it open keep working
+ * until closed, the last close frees the device.
+ */
+static int destroy_device(unsigned int index)
+{
+    struct mytest_dev* dev;
+
+    if (index >= par_max_devices)
+        return -EINVAL;
+
+    mutex_lock(&mytest_devs_lock);
+    dev = mytest_devs[index];
+    mytest_devs[index] = NULL;
+    mutex_unlock(&mytest_devs_lock);
+
+    if (dev == NULL)
+        return -ENODEV;
+
+    remove_device(dev);
+
+    return 0;
+}
+
+static void remove_device(struct mytest_dev* dev)
+{
+    struct mytest_file* mf;
+
+    /*
+     * If this is a normal (not forced) unloading or failure during initial 
+     * loading, then by the time we get called all references to devices should
+     * be gone, see release_all(). A device destroyed through sysfs can still
+     * be open, in which case the final kref_put() happens on last close.
+     *
+     * debugfs_remove_recursive() waits for debugfs readers to leave, so only
+     * the files' own references to dev go away here.
+     */
+    debugfs_remove_recursive(dev->debugfs);
+    dev->debugfs = NULL;
+
+    if (dev->cdev_device)
+    {
+        device_destroy(my_cdev_class, dev->devno);
+        dev->cdev_device = NULL;
+    }
+
+    if (dev->cdev)
+    {
+        cdev_del(dev->cdev);
+        dev->cdev = NULL;
+    }
+
+    /*
+     * This wake up does not have any effect during normal module unloading,
+     * since by that time all references to the device should be gone. 
+     * It can be of some use in case of force-unloading (all bets are off then, 
+     * of course) or if the device is destroyed while still open.
+     * Blocked readers return 0, pollers see POLLHUP.
+     */
+    WRITE_ONCE(dev->removed, true);
+    smp_mb();
+    wake_up_all(&dev->out_wait_q);
+
+    spin_lock(&dev->files_lock);
+    list_for_each_entry(mf, &dev->files, link)
+        wake_up_all(&mf->wait_q);
+    spin_unlock(&dev->files_lock);
+
+    /* mytest_append() calls that found the device in mytest_devs[] are done */
+    synchronize_rcu();
+
+    kref_put(&dev->ref, mytest_dev_release);
+}
+
+static void mytest_dev_release(struct kref* ref)
+{
+    struct mytest_dev* dev = container_of(ref, struct mytest_dev, ref);
+
+    cancel_delayed_work_sync(&dev->stage_work);
+    cancel_work_sync(&dev->trim_work);
+    cancel_work_sync(&dev->evict_work);
+    evict_work_func(&dev->evict_work);
+    free_producers(dev);
+    free_stages(dev);
+    free_groups(dev);
+    free_archive(dev);
+    kvfree(dev->rindex);
+    free_chunks(dev);
+    free_percpu(dev->stats);
+    kfree(dev->stats_base);
+    kfree(dev);
+}
+
+/*
+ * echo [size] > /sys/class/mytest/create
+ *
+ * Creates a device in the first free slot, retaining up to size bytes
+ * (K/M/G suffixes accepted), or the maxsize module parameter by default.
+ */
+static ssize_t create_store(struct class* cls, struct class_attribute* attr, const char* buf, size_t count)
+{
+    unsigned long long maxsize = par_maxsize;
+    char* end;
+    int index;
+
+    buf = skip_spaces(buf);
+    if (*buf)
+    {
+        maxsize = memparse(buf, &end);
+        if (end == buf || *skip_spaces(end) || maxsize > SIZE_MAX / 2)
+            return -EINVAL;
+    }
+
+    index = create_device(-1, maxsize);
+    if (index < 0)
+        return index;
+
+    printk(KERN_ALERT "mytest: created " DEVICE_NAME "%d, maxsize %llu\n", index, maxsize);
+
+    return count;
+}
+
+/*
+ * echo index > /sys/class/mytest/destroy
+ */
+static ssize_t destroy_store(struct class* cls, struct class_attribute* attr, const char* buf, size_t count)
+{
+    unsigned int index;
+    int error;
+
+    error = kstrtouint(buf, 0, &index);
+    if (error)
+        return error;
+
+    error = destroy_device(index);
+    if (error)
+        return error;
+
+    printk(KERN_ALERT "mytest: destroyed " DEVICE_NAME "%u\n", index);
+
+    return count;
+}
+
+static ssize_t maxsize_show(struct device* d, struct device_attribute* attr, char* buf)
+{
+    struct mytest_dev* dev = (struct mytest_dev*) dev_get_drvdata(d);
+    return sprintf(buf, "%zu\n", dev->maxsize);
+}
+
+static ssize_t node_show(struct device* d, struct device_attribute* attr, char* buf)
+{
+    struct mytest_dev* dev = (struct mytest_dev*) dev_get_drvdata(d);
+    return sprintf(buf, "%d\n", READ_ONCE(dev->node));
+}
+
+/*
+ * echo node > /sys/class/mytest/mytestN/node (-1 for any)
+ *
+ * Applies to chunks allocated from then on, chunks already there stay where
+ * they are. In ring mode all chunks are allocated up front, switching ring
+ * mode off and on again moves them.
+ */
+static ssize_t node_store(struct device* d, struct device_attribute* attr, const char* buf, size_t count)
+{
+    struct mytest_dev* dev = (struct mytest_dev*) dev_get_drvdata(d);
+    int node;
+    int error;
+
+    error = kstrtoint(buf, 0, &node);
+    if (error)
+        return error;
+    if (!valid_node(node))
+        return -EINVAL;
+
+    WRITE_ONCE(dev->node, node);
+    return count;
+}
+
+static const char* const shrink_names[MYTEST_NSHRINK] = { "off", "unread", "oldest" };
+
+static ssize_t shrink_show(struct device* d, struct device_attribute* attr, char* buf)
+{
+    struct mytest_dev* dev = (struct mytest_dev*) dev_get_drvdata(d);
+    return sprintf(buf, "%s\n", shrink_names[READ_ONCE(dev->shrink)]);
+}
+
+/*
+ * echo off|unread|oldest > /sys/class/mytest/mytestN/shrink
+ */
+static ssize_t shrink_store(struct device* d, struct device_attribute* attr, const char* buf, size_t count)
+{
+    struct mytest_dev* dev = (struct mytest_dev*) dev_get_drvdata(d);
+    int shrink = parse_shrink(buf);
+
+    if (shrink < 0)
+        return shrink;
+
+    WRITE_ONCE(dev->shrink, shrink);
+    return count;
+}
+
+static void my_callout(unsigned long arg)
+{
+    struct my_timer_list* t;
+
+    BUILD_BUG_ON(sizeof(unsigned long) < sizeof(void*));
+
+    t = (struct my_timer_list*) arg;
+    /* cpu and irq/softirq context are in the trace record header */
+    trace_mytest_timer(t->m_index, preempt_count());
+
+    if (READ_ONCE(par_timer_log))
+    {
+        char rec[64];
+        int len = scnprintf(rec, sizeof(rec), "mytest: timer %u on cpu %d, jiffies %lu\n",
+                            t->m_index, smp_processor_id(), jiffies);
+        mytest_append(0, rec, len);
+    }
+
+    mod_timer(& t->m_tmr, jiffies + msecs_to_jiffies(8 * 1000));
+}
+
+static int my_thread_func(void* data)
+{
+    struct my_thread_struct* t = (struct my_thread_struct*) data;
+    // int old_nice;
+    // int new_nice;
+
+    printk(KERN_ALERT "mytest: thread %d\n", t->m_index);
 
     // old_nice = task_nice(current);
     // set_user_nice(current, -10)
     // new_nice = task_nice(current);
     // printk(KERN_ALERT "mytest: thread %d (nice: %d -> %d)\n", t->m_index, old_nice, new_nice);
 
-    if (t->m_index == 0)
+    if (t->m_index == 0)
+    {
+        struct sched_param sp;
+        int err;
+        display_prio(t);
+        sp.sched_priority = MAX_RT_PRIO - 1;
+        err = sched_setscheduler(current, SCHED_RR, &sp);
+        if (err)
+            printk(KERN_ALERT "mytest: failed to set thread priority, error: %d\n", err);
+        display_prio(t);
+    }
+
+    /*
+     * Thread 0 runs SCHED_RR at top priority, so it gets no buffer and takes
+     * no search pieces, which users could otherwise drive at that priority.
+     * Without a buffer a thread does not help, searches still complete.
+     */
+    if (t->m_index != 0)
+    {
+        t->m_scratch = vmalloc(MYTEST_SEARCH_PIECE + MYTEST_SEARCH_PATTERN_MAX);
+        if (t->m_scratch == NULL)
+            printk(KERN_ALERT "mytest: thread %d: unable to allocate search buffer\n", t->m_index);
+    }
+
+    /* thread 0 runs SCHED_RR at top priority, background compression is left to the others */
+    if (t->m_index != 0 && t->m_scratch)
+    {
+        t->m_zwork = vmalloc(LZ4_MEM_COMPRESS);
+        t->m_zbuf = vmalloc(LZ4_COMPRESSBOUND(MYTEST_ZBLOCK));
+        if (t->m_zwork == NULL || t->m_zbuf == NULL)
+        {
+            printk(KERN_ALERT "mytest: thread %d: unable to allocate compression buffers\n", t->m_index);
+            vfree(t->m_zwork);
+            vfree(t->m_zbuf);
+            t->m_zwork = NULL;
+            t->m_zbuf = NULL;
+        }
+    }
+
+    for (;;)
+    {
+        struct mytest_search_job* job = NULL;
+        struct mytest_dev* zdev = NULL;
+        long left;
+
+        left = wait_event_interruptible_timeout(search_wait_q,
+                   kthread_should_stop() ||
+                   (t->m_scratch && (job = get_search_job()) != NULL) ||
+                   (t->m_zwork && (zdev = get_compress_dev(t->m_node)) != NULL),
+                   8 * HZ);
+
+        if (kthread_should_stop())
+        {
+            if (job)
+                put_search_job(job);
+            if (zdev)
+                kref_put(&zdev->ref, mytest_dev_release);
+            vfree(t->m_scratch);
+            vfree(t->m_zwork);
+            vfree(t->m_zbuf);
+            t->m_scratch = NULL;
+            t->m_zwork = NULL;
+            t->m_zbuf = NULL;
+            printk(KERN_ALERT "mytest: thread %d exiting...\n", t->m_index);
+            return 0;
+        }
+
+        if (job)
+        {
+            run_search(job, t->m_index, t->m_scratch);
+            put_search_job(job);
+        }
+        else if (zdev)
+        {
+            /* back of the queue if there is more, so that other devices get a turn */
+            if (compress_blocks(zdev, t))
+                queue_compress(zdev);
+            kref_put(&zdev->ref, mytest_dev_release);
+        }
+        else if (left == 0)
+        {
+            trace_mytest_thread_tick(t->m_index);
+        }
+    }
+
+    // do_exit();
+    // return 0;
+}
+
+static void display_prio(struct my_thread_struct* t)
+{
+    switch (current->policy)
+    {
+    case SCHED_NORMAL:
+        printk(KERN_ALERT "mytest: thread %d (SCHED_NORMAL, nice=%d)\n", t->m_index, task_nice(current));
+        break;
+
+    case SCHED_FIFO:
+        printk(KERN_ALERT "mytest: thread %d (SCHED_FIFO, rt_prio=%u)\n", t->m_index, current->rt_priority);
+        break;
+
+    case SCHED_RR:
+        printk(KERN_ALERT "mytest: thread %d (SCHED_RR, rt_prio=%u)\n", t->m_index, current->rt_priority);
+        break;
+
+    case SCHED_BATCH:
+        printk(KERN_ALERT "mytest: thread %d (SCHED_BATCH, nice=%d)\n", t->m_index, task_nice(current));
+        break;
+
+    case SCHED_IDLE:
+        printk(KERN_ALERT "mytest: thread %d (SCHED_IDLE, nice=%d)\n", t->m_index, task_nice(current));
+        break;
+
+    default:
+        printk(KERN_ALERT "mytest: thread %d (SCHED class %u)\n", t->m_index, current->policy);
+        break;
+    }
+}
+
+static int my_cdev_open(struct inode* inode, struct file* filp)
+{
+    unsigned int mj = imajor(inode);
+    unsigned int mn = iminor(inode);
+    struct mytest_dev* dev;
+    struct mytest_file* mf;
+    
+    if (mj != my_cdev_major || mn < my_cdev_minor || mn >= my_cdev_minor + par_max_devices)
+        return -ENODEV;
+
+    /* the device may be getting destroyed through sysfs right now */
+    mutex_lock(&mytest_devs_lock);
+    dev = mytest_devs[mn - my_cdev_minor];
+    if (dev == NULL || inode->i_cdev != dev->cdev)
+    {
+        mutex_unlock(&mytest_devs_lock);
+        return -ENODEV;
+    }
+    kref_get(&dev->ref);
+    mutex_unlock(&mytest_devs_lock);
+
+    mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+    if (mf == NULL)
+    {
+        kref_put(&dev->ref, mytest_dev_release);
+        return -ENOMEM;
+    }
+    mf->dev = dev;
+    mf->filp = filp;
+    atomic64_set(&mf->lost, 0);
+    INIT_LIST_HEAD(&mf->link);
+    init_waitqueue_head(&mf->wait_q);
+    mf->wake_bytes = 1;
+    hrtimer_init(&mf->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    mf->wake_timer.function = wake_timer_func;
+
+    if (filp->f_mode & FMODE_READ)
+    {
+        spin_lock(&dev->files_lock);
+        list_add_tail(&mf->link, &dev->files);
+        spin_unlock(&dev->files_lock);
+    }
+
+    /* store a pointer to per-open state here for other methods */
+    filp->private_data = mf; 
+
+    /* read_iter/write_iter honor IOCB_NOWAIT, so RWF_NOWAIT and AIO can complete inline */
+    filp->f_mode |= FMODE_NOWAIT;
+    
+    /* may want to initialized dev here on first or next opening */
+
+    return 0;
+}
+
+static int my_cdev_release(struct inode* inode, struct file* filp)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev *dev = mf->dev;
+
+    spin_lock(&dev->files_lock);
+    list_del(&mf->link);
+    spin_unlock(&dev->files_lock);
+    hrtimer_cancel(&mf->wake_timer);
+
+    /* the group itself stays, with its cursor */
+    if (mf->group)
+    {
+        mutex_lock(&dev->groups_lock);
+        mf->group->members--;
+        mutex_unlock(&dev->groups_lock);
+    }
+
+    kfree(mf);
+
+    /* last close of a device destroyed through sysfs frees it */
+    kref_put(&dev->ref, mytest_dev_release);
+
+    return 0;
+}
+
+/*
+ * File operations proper are do_xxx(), these wrappers account them in
+ * the device statistics.
+ */
+static ssize_t my_cdev_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+    struct mytest_file* mf = (struct mytest_file*) iocb->ki_filp->private_data;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    u64 t0 = opstat_begin();
+    ssize_t ret = do_read_iter(iocb, to);
+    opstat_end(mf->dev, MYTEST_OP_READ, t0, ret);
+    trace_mytest_read(mf->dev->index, pos, count, ret);
+    return ret;
+}
+
+static ssize_t my_cdev_write_iter(struct kiocb* iocb, struct iov_iter* from)
+{
+    struct mytest_file* mf = (struct mytest_file*) iocb->ki_filp->private_data;
+    u64 t0;
+    ssize_t ret;
+
+    trace_mytest_write_enter(mf->dev->index, iov_iter_count(from));
+    t0 = opstat_begin();
+    ret = do_write_iter(iocb, from);
+    opstat_end(mf->dev, MYTEST_OP_WRITE, t0, ret);
+    trace_mytest_write_exit(mf->dev->index, ret, READ_ONCE(mf->dev->buffer_size));
+    return ret;
+}
+
+static unsigned int my_cdev_poll(struct file* filp, struct poll_table_struct* wait)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    u64 t0 = opstat_begin();
+    unsigned int mask = do_poll(filp, wait);
+    opstat_end(mf->dev, MYTEST_OP_POLL, t0, 0);
+    trace_mytest_poll(mf->dev->index, filp->f_pos, READ_ONCE(mf->dev->buffer_size), mask);
+    return mask;
+}
+
+static long my_cdev_unlocked_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    u64 t0 = opstat_begin();
+    long ret = do_ioctl(filp, cmd, arg);
+    opstat_end(mf->dev, MYTEST_OP_IOCTL, t0, ret < 0 ? ret : 0);
+    trace_mytest_ioctl(mf->dev->index, cmd, ret);
+    return ret;
+}
+
+/*
+ * Take a mutex, accounting the time spent waiting if it is contended.
+ * Returns 0, -EAGAIN (nowait) or -ERESTARTSYS.
+ */
+static int lock_timed(struct mytest_dev* dev, struct mutex* lock, bool nowait)
+{
+    u64 t0;
+    int error = 0;
+
+    if (mutex_trylock(lock))
+        return 0;
+    if (nowait)
+        return -EAGAIN;
+
+    t0 = opstat_begin();
+    if (mutex_lock_interruptible(lock))
+        error = -ERESTARTSYS;
+
+    if (t0)
+    {
+        this_cpu_inc(dev->stats->lock_waits);
+        this_cpu_add(dev->stats->lock_wait_ns, max_t(s64, local_clock() - t0, 0));
+    }
+
+    return error;
+}
+
+/* loff_t is long long */
+/* size_t is ulong */
+
+/*
+ * Plain write(), writev() and splice into the device all come here, so a
+ * vectored write is appended in one go under a single acquisition of wlock
+ * (or staged in one go, see stage_write()).
+ */
+static ssize_t do_write_iter(struct kiocb* iocb, struct iov_iter* from)
+{
+    struct file* filp = iocb->ki_filp;
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev *dev = mf->dev;
+    ssize_t ret;
+
+    /* write to our device is append-only, so we ignore the value of ki_pos on input */
+
+    if (smp_load_acquire(& dev->staging))
+        ret = stage_write(dev, from, io_nowait(iocb));
+    else
+        ret = append_iter(dev, from, io_nowait(iocb), false);
+
+    if (ret > 0)
+        iocb->ki_pos += ret;
+
+    return ret;
+}
+
+/*
+ * Append the contents of an iterator to the device.
+ * Returns the number of bytes consumed from the iterator or an error.
+ * When the device cannot take all of it, the oldest part is skipped in ring
+ * mode and the rest is cut off otherwise, unless whole is set: then nothing
+ * is stored and 0 returned.
+ */
+static ssize_t append_iter(struct mytest_dev* dev, struct iov_iter* from, bool nowait, bool whole)
+{
+    size_t count = iov_iter_count(from);
+    size_t start;
+    size_t size;
+    size_t skip = 0;
+    size_t done;
+    ssize_t error = 0;
+
+    /*
+     * wlock serializes writers only. Readers never take it, so a writer that
+     * blocks in page allocation or faults in copy_from_user() delays other
+     * writers but not readers.
+     *
+     * Non-blocking callers never sleep on the lock or in page reclaim, they
+     * get -EAGAIN instead and can retry from a context that may block.
+     */
+    error = lock_timed(dev, & dev->wlock, nowait);
+    if (error)
+        return error;
+
+    /* checked under wlock, the mode only changes while the device is empty */
+    if (dev->framed)
+        return append_record(dev, from, nowait);
+
+    start = dev->buffer_start;
+    size = dev->buffer_size;
+
+    if (dev->ring)
+    {
+        /* only the newest dev->maxsize bytes of a large write would survive anyway */
+        if (count > dev->maxsize && whole)
+        {
+            count = 0;
+        }
+        else if (count > dev->maxsize)
+        {
+            skip = count - dev->maxsize;
+            count = dev->maxsize;
+            iov_iter_advance(from, skip);
+        }
+
+        /*
+         * Retire the oldest data before its chunks get overwritten. Readers
+         * recheck buffer_start after copying (smp_rmb() in read_window()),
+         * so they can tell if the bytes they copied were clobbered meanwhile.
+         */
+        if (size + count - start > dev->maxsize)
+        {
+            start = size + count - dev->maxsize;
+            WRITE_ONCE(dev->buffer_start, start);
+            WRITE_ONCE(mmap_header(dev)->data_start, start);
+            smp_wmb();
+        }
+    }
+    else
+    {
+        /* data that is safe in the archive can leave the window to make room */
+        if (size + count - start > dev->maxsize && READ_ONCE(dev->compress))
+        {
+            size_t archived = smp_load_acquire(& dev->znext) * MYTEST_ZBLOCK;
+            size_t want = min(size + count - dev->maxsize, archived);
+
+            if (want > start)
+            {
+                start = want;
+                WRITE_ONCE(dev->buffer_start, start);
+                WRITE_ONCE(mmap_header(dev)->data_start, start);
+                smp_wmb();
+            }
+        }
+
+        if (whole && count > dev->maxsize - (size - start))
+            count = 0;
+        count = min(count, dev->maxsize - (size - start));
+    }
+
+    if (count == 0)
+    {
+        mutex_unlock(& dev->wlock);
+        return 0;
+    }
+
+    done = store_iter(dev, size, from, count, nowait, &error);
+
+    /* partial write counts as success, as long as something was stored */
+    if (done == 0)
+    {
+        mutex_unlock(& dev->wlock);
+        return error;
+    }
+
+    /*
+     * Publish: the release store orders page contents and pages[] entries
+     * before the new size, pairing with smp_load_acquire() in readers.
+     */
+    size += done;
+    smp_store_release(& dev->buffer_size, size);
+    smp_wmb();
+    WRITE_ONCE(mmap_header(dev)->data_size, size);
+
+    mutex_unlock(& dev->wlock);
+
+    wake_readers(dev);
+
+    if (READ_ONCE(dev->compress) && archive_limit(dev, size) >= (READ_ONCE(dev->znext) + 1) * MYTEST_ZBLOCK)
+        queue_compress(dev);
+
+    return skip + done;
+}
+
+/*
+ * Copy count bytes from an iterator into the chunks at stream offset.
+ * Returns the number of bytes stored, if short *error says why.
+ *
+ * Data is kept in page-sized chunks, so an append only copies the new bytes
+ * and never needs a large contiguous allocation. Everything written here
+ * lies beyond the published buffer_size, so readers do not look at it yet.
+ * In ring mode all chunks are preallocated and nothing is allocated here,
+ * unless the shrinker took some back. Caller holds wlock.
+ */
+static size_t store_iter(struct mytest_dev* dev, size_t offset, struct iov_iter* from, size_t count, bool nowait, ssize_t* error)
+{
+    gfp_t gfp = nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL;
+    size_t done = 0;
+
+    while (done < count)
+    {
+        size_t pgoff = (offset + done) & ~PAGE_MASK;
+        size_t n = min(count - done, (size_t) PAGE_SIZE - pgoff);
+        struct page** slot = chunk_slot(dev, offset + done);
+        struct page* page = *slot;
+        size_t copied;
+
+        if (page == NULL)
+        {
+            page = alloc_chunk(dev, gfp);
+            if (page == NULL)
+            {
+                *error = nowait ? -EAGAIN : -ENOMEM;
+                break;
+            }
+            smp_store_release(slot, page);
+        }
+
+        copied = copy_page_from_iter(page, pgoff, n, from);
+        done += copied;
+        if (copied != n)
+        {
+            *error = -EFAULT;
+            break;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * Readers take no lock and never sleep other than in user page faults,
+ * so IOCB_NOWAIT needs no special handling here.
+ *
+ * Data in the published window is not modified while
+ * it stays in the window, so it can be copied out directly after an acquire
+ * load of the size.
+ *
+ * In ring mode the oldest data can be overwritten under the reader's feet.
+ * The writer moves buffer_start past such data before touching it, so after
+ * copying the reader checks buffer_start again and retries from the new start
+ * if its bytes went out of the window. Bytes a reader missed this way are
+ * accounted in mytest_file->lost and reported by IOC_MYTEST_GET_LOST.
+ *
+ * Chunks that leave the window can also be freed (group trimming, the
+ * shrinker). Whoever frees them first moves buffer_start past them and clears
+ * their slots, then waits for a chunk_srcu grace period before releasing the
+ * pages, and copy_chunks_to_iter() copies inside a chunk_srcu read section.
+ * A page it has looked up thus stays valid until it is done, and a slot it
+ * finds empty stops the copy short; either way the buffer_start recheck sends
+ * the reader to the new start, like an overwrite does.
+ */
+static ssize_t read_window(struct kiocb* iocb, struct iov_iter* to)
+{
+    struct file* filp = iocb->ki_filp;
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev *dev = mf->dev;
+    size_t count = iov_iter_count(to);
+    size_t offset;
+    size_t start;
+    size_t size;
+    size_t len;
+    size_t done;
+    bool flushed = false;
+
+    if (iocb->ki_pos < 0)
+        return -EINVAL;
+    offset = iocb->ki_pos;
+
+    for (;;)
+    {
+        size = smp_load_acquire(& dev->buffer_size);
+        start = READ_ONCE(dev->buffer_start);
+
+        if (offset < start)
+        {
+            if (READ_ONCE(dev->compress))
+            {
+                ssize_t ret = read_archive(dev, to, &offset, count, &mf->lost, io_nowait(iocb));
+                if (ret > 0)
+                    iocb->ki_pos = offset + ret;
+                if (ret != 0)
+                    return ret;
+                if (offset >= start)
+                    continue;
+            }
+
+            atomic64_add(start - offset, &mf->lost);
+            offset = start;
+        }
+
+        /* reader caught up, pull in whatever is sitting in staging buffers */
+        if (offset >= size && !flushed && smp_load_acquire(& dev->staging))
+        {
+            flush_stages(dev, io_nowait(iocb));
+            flushed = true;
+            continue;
+        }
+
+        if (offset >= size || count == 0)
+        {
+            iocb->ki_pos = offset;
+            return 0;
+        }
+
+        len = min(count, size - offset);
+        if (READ_ONCE(dev->framed))
+            len = whole_records(dev, offset, len);
+
+        done = len ? copy_chunks_to_iter(dev, to, offset, len) : 0;
+
+        smp_rmb();
+        if (READ_ONCE(dev->buffer_start) <= offset)
+            break;
+
+        iov_iter_revert(to, done);
+    }
+
+    /* the next record does not fit into the buffer at all */
+    if (len == 0)
+        return -EMSGSIZE;
+
+    /* records are returned whole or not at all */
+    if (done != len && READ_ONCE(dev->framed))
+    {
+        iov_iter_revert(to, done);
+        return -EFAULT;
+    }
+
+    if (done == 0)
+        return -EFAULT;
+    
+    iocb->ki_pos = offset + done;
+
+    return done;
+}
+
+/*
+ * A read at the end of data fails with -EAGAIN if non-blocking. Otherwise it
+ * waits until there is data to read, as much as the file's wakeup thresholds
+ * ask for (see reader_ready()), so that one read returns a whole batch. It
+ * returns 0 once the device is destroyed, and -ETIMEDOUT after the read
+ * timeout (IOC_MYTEST_SET_READ_TIMEOUT) if one is set.
+ *
+ * Group members wait outside the group lock, and go back to sleep if other
+ * members took the data first.
+ */
+static ssize_t do_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+    struct mytest_file* mf = (struct mytest_file*) iocb->ki_filp->private_data;
+    struct mytest_dev* dev = mf->dev;
+    long left = READ_ONCE(mf->read_timeout);
+    ssize_t ret;
+
+    if (left == 0)
+        left = MAX_SCHEDULE_TIMEOUT;
+
+    for (;;)
+    {
+        ret = read_data(iocb, to);
+        if (ret != 0 || iov_iter_count(to) == 0 || READ_ONCE(dev->removed))
+            return ret;
+
+        if (io_nowait(iocb))
+            return -EAGAIN;
+
+        left = wait_event_interruptible_timeout(mf->wait_q,
+                   READ_ONCE(dev->removed) ||
+                   reader_ready(mf, smp_load_acquire(& dev->buffer_size), ktime_get_ns()),
+                   left);
+        if (left < 0)
+            return left;
+        if (left == 0)
+            return -ETIMEDOUT;
+    }
+}
+
+/*
+ * Reads of a group member continue from the group cursor and move it,
+ * under the group lock so that members never get the same bytes.
+ */
+static ssize_t read_data(struct kiocb* iocb, struct iov_iter* to)
+{
+    struct mytest_file* mf = (struct mytest_file*) iocb->ki_filp->private_data;
+    struct mytest_consumer_group* g;
+    size_t old;
+    ssize_t ret;
+
+    g = lock_group(mf, io_nowait(iocb));
+    if (IS_ERR(g))
+        return PTR_ERR(g);
+    if (g == NULL)
+        return read_window(iocb, to);
+
+    old = g->cursor;
+    iocb->ki_pos = old;
+    ret = read_window(iocb, to);
+    WRITE_ONCE(g->cursor, iocb->ki_pos);
+
+    mutex_unlock(&g->lock);
+
+    /* leading chunks may be free now */
+    if ((old >> PAGE_SHIFT) != (iocb->ki_pos >> PAGE_SHIFT))
+        schedule_work(&mf->dev->trim_work);
+
+    return ret;
+}
+
+static loff_t my_cdev_llseek(struct file* filp, loff_t offset, int whence)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev *dev = mf->dev;
+    struct mytest_consumer_group* g;
+    size_t size = smp_load_acquire(& dev->buffer_size);
+    size_t start = retained_start(dev);
+    loff_t newpos = 0;
+
+    /* a group member moves the group cursor */
+    g = lock_group(mf, false);
+    if (IS_ERR(g))
+        return PTR_ERR(g);
+
+    switch(whence)
+    {
+    case SEEK_SET:
+        newpos = offset;
+        break;
+
+    case SEEK_CUR:
+        newpos = (g ? g->cursor : filp->f_pos) + offset;
+        break;
+
+    case SEEK_END:
+        newpos = size + offset;
+        break;
+
+    default:
+        newpos = -1;
+        break;
+    }
+
+    if (newpos < 0 || newpos > size) 
+    {
+        if (g)
+            mutex_unlock(&g->lock);
+        return -EINVAL;
+    }
+
+    /* positions that already left the window land on the oldest retained byte */
+    if (newpos < start)
+        newpos = start;
+
+    if (g)
+    {
+        WRITE_ONCE(g->cursor, newpos);
+        mutex_unlock(&g->lock);
+        schedule_work(&dev->trim_work);
+    }
+
+    filp->f_pos = newpos;
+    return newpos;
+}
+
+static unsigned int do_poll(struct file* filp, struct poll_table_struct* wait)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev *dev = mf->dev;
+    unsigned int mask = 0;
+    size_t size;
+    bool ready;
+
+    poll_wait(filp, &mf->wait_q, wait);
+    if (filp->f_mode & FMODE_WRITE)
+        poll_wait(filp, &dev->out_wait_q, wait);
+
+    size = smp_load_acquire(& dev->buffer_size);
+    ready = reader_ready(mf, size, ktime_get_ns());
+
+    if (!ready && smp_load_acquire(& dev->staging))
+    {
+        flush_stages(dev, true);
+        size = smp_load_acquire(& dev->buffer_size);
+        ready = reader_ready(mf, size, ktime_get_ns());
+    }
+
+    if (ready)
+        mask |= POLLIN | POLLRDNORM;
+
+    if (READ_ONCE(dev->removed))
+        mask |= POLLHUP;
+
+    if (READ_ONCE(dev->ring) || size - READ_ONCE(dev->buffer_start) < dev->maxsize ||
+        (READ_ONCE(dev->compress) && READ_ONCE(dev->znext) * MYTEST_ZBLOCK > READ_ONCE(dev->buffer_start)))
+        mask |= POLLOUT | POLLWRNORM;
+
+    return mask;
+}
+
+/*
+ * Map device data read-only. Page 0 of the mapping is the header page,
+ * page N + 1 is data chunk N. Pages are supplied on demand by my_vm_fault(),
+ * so the mapping can be created up front and will see data appended later.
+ */
+static int my_cdev_mmap(struct file* filp, struct vm_area_struct* vma)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev *dev = mf->dev;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EACCES;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &my_vm_ops;
+    vma->vm_private_data = dev;
+
+    return 0;
+}
+
+static int my_vm_fault(struct vm_fault* vmf)
+{
+    struct mytest_dev *dev = (struct mytest_dev*) vmf->vma->vm_private_data;
+    struct page* page;
+    size_t k;
+    int idx;
+
+    if (vmf->pgoff == 0)
+    {
+        page = dev->hdr_page;
+        get_page(page);
+    }
+    else
+    {
+        k = vmf->pgoff - 1;
+        if (k >= dev->npages)
+            return VM_FAULT_SIGBUS;
+
+        /* chunks trimmed after consumer groups read them may be on their way out */
+        idx = srcu_read_lock(&chunk_srcu);
+        page = smp_load_acquire(& dev->pages[k]);
+        if (page)
+            get_page(page);
+        srcu_read_unlock(&chunk_srcu, idx);
+
+        if (page == NULL)
+            return VM_FAULT_SIGBUS;
+    }
+
+    /* reference is handed over to the page table entry */
+    vmf->page = page;
+    return 0;
+}
+
+/*
+ * New ioctl interface as of 2.6.11.
+ * BKL is not taken prior to the call.
+ * inode is available as filp->f_dentry->d_inode.
+ */
+static long do_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev *dev = mf->dev;
+    long error;
+
+    if (cmd == IOC_MYTEST_PRINT)
+    {
+        char buf[135];
+        error = strncpy_from_user(buf, (const char __user*) arg, sizeof(buf));
+        if (error < 0)  return error;
+        buf[sizeof(buf) - 1] = 0;
+        printk(KERN_ALERT "mytest user print: [%s]\n", buf);
+        return 0;
+    }
+    else if (cmd == IOC_MYTEST_PANIC)
+    {
+        char buf[135];
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        error = strncpy_from_user(buf, (const char __user*) arg, sizeof(buf));
+        if (error < 0)  return error;
+        buf[sizeof(buf) - 1] = 0;
+        call_fs_sync(); call_fs_sync(); call_fs_sync();
+        panic("mytest user panic: [%s]", buf);
+        return 0;
+    }
+    else if (cmd == IOC_MYTEST_OOPS)
+    {
+        static volatile int res;
+        static volatile int zero = 0;
+
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+
+        printk(KERN_ALERT "mytest: about do to oops ...\n");
+        call_fs_sync(); call_fs_sync(); call_fs_sync();
+        res = 100 / zero;
+        printk(KERN_ALERT "mytest: completed oops.\n");
+        return 0;
+    }
+    else if (cmd == IOC_MYTEST_SET_RING)
+    {
+        int ring;
+        if (!(filp->f_mode & FMODE_WRITE))
+            return -EPERM;
+        if (get_user(ring, (int __user*) arg))
+            return -EFAULT;
+        return set_ring_mode(dev, ring != 0);
+    }
+    else if (cmd == IOC_MYTEST_SET_STAGING)
+    {
+        int staging;
+        if (!(filp->f_mode & FMODE_WRITE))
+            return -EPERM;
+        if (get_user(staging, (int __user*) arg))
+            return -EFAULT;
+        return set_staging(dev, staging != 0);
+    }
+    else if (cmd == IOC_MYTEST_SET_COMPRESS)
+    {
+        int compress;
+        if (!(filp->f_mode & FMODE_WRITE))
+            return -EPERM;
+        if (get_user(compress, (int __user*) arg))
+            return -EFAULT;
+        return set_compress(dev, compress != 0);
+    }
+    else if (cmd == IOC_MYTEST_SET_FRAMED)
+    {
+        int framed;
+        if (!(filp->f_mode & FMODE_WRITE))
+            return -EPERM;
+        if (get_user(framed, (int __user*) arg))
+            return -EFAULT;
+        return set_framed(dev, framed != 0);
+    }
+    else if (cmd == IOC_MYTEST_SEEK)
+    {
+        if (!(filp->f_mode & FMODE_READ))
+            return -EPERM;
+        return do_seek_record(filp, (struct mytest_seek __user*) arg);
+    }
+    else if (cmd == IOC_MYTEST_JOIN_GROUP)
+    {
+        if (!(filp->f_mode & FMODE_READ))
+            return -EPERM;
+        return join_group(mf, (struct mytest_group __user*) arg);
+    }
+    else if (cmd == IOC_MYTEST_LEAVE_GROUP)
+    {
+        return leave_group(mf);
+    }
+    else if (cmd == IOC_MYTEST_DELETE_GROUP)
+    {
+        if (!(filp->f_mode & FMODE_READ))
+            return -EPERM;
+        return delete_group(dev, (const struct mytest_group __user*) arg);
+    }
+    else if (cmd == IOC_MYTEST_GET_LOST)
+    {
+        __u64 lost = atomic64_xchg(&mf->lost, 0);
+        if (copy_to_user((void __user*) arg, &lost, sizeof(lost)))
+            return -EFAULT;
+        return 0;
+    }
+    else if (cmd == IOC_MYTEST_SET_WAKEUP)
+    {
+        if (!(filp->f_mode & FMODE_READ))
+            return -EPERM;
+        return set_wakeup(mf, (const struct mytest_wakeup __user*) arg);
+    }
+    else if (cmd == IOC_MYTEST_SET_READ_TIMEOUT)
+    {
+        __u32 ms;
+        if (get_user(ms, (__u32 __user*) arg))
+            return -EFAULT;
+        WRITE_ONCE(mf->read_timeout, ms ? msecs_to_jiffies(ms) : 0);
+        return 0;
+    }
+    else if (cmd == IOC_MYTEST_BATCH)
+    {
+        return do_batch(filp, (struct mytest_batch __user*) arg);
+    }
+    else if (cmd == IOC_MYTEST_IPI_BENCH)
+    {
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        return do_ipi_bench((struct mytest_ipi_bench __user*) arg);
+    }
+    else if (cmd == IOC_MYTEST_SEARCH)
+    {
+        if (!(filp->f_mode & FMODE_READ))
+            return -EPERM;
+        return do_search(filp, (struct mytest_search __user*) arg);
+    }
+    else
+    {
+        return -EINVAL;
+    }
+}
+
+/*
+ * Used by 32-bit processes on 64-bit systems.
+ * Should provide conversion of arguments if required.
+ * BKL is not taken prior to the call.
+ * inode is available as filp->f_dentry->d_inode.
+ *
+ * All our argument structures are built from fixed-size types with pointers
+ * in __u64 fields, so they have the same layout for 32-bit callers and only
+ * the argument pointer itself needs converting.
+ */
+static long my_cdev_compat_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
+{
+#ifdef CONFIG_COMPAT
+    arg = (unsigned long) compat_ptr(arg);
+#endif
+    return my_cdev_unlocked_ioctl(filp, cmd, arg);
+}
+
+/*
+ * Process IOC_MYTEST_BATCH. Entries are copied in and their statuses copied
+ * back in groups, so a batch costs a handful of user copies rather than
+ * one syscall per command.
+ */
+static long do_batch(struct file* filp, struct mytest_batch __user* ubatch)
+{
+    struct mytest_batch batch;
+    struct mytest_batch_entry ents[16];
+    struct mytest_batch_entry __user* uents;
+    __u32 k, n, i;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.flags || batch.count > MYTEST_BATCH_MAX)
+        return -EINVAL;
+
+    uents = (struct mytest_batch_entry __user*) u64_to_user_ptr(batch.entries);
+
+    for (k = 0;  k < batch.count;  k += n)
+    {
+        n = min_t(__u32, batch.count - k, ARRAY_SIZE(ents));
+
+        if (copy_from_user(ents, uents + k, n * sizeof(ents[0])))
+            return -EFAULT;
+
+        for (i = 0;  i < n;  i++)
+            ents[i].status = do_batch_entry(filp, &ents[i]);
+
+        if (copy_to_user(uents + k, ents, n * sizeof(ents[0])))
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
+static int do_batch_entry(struct file* filp, const struct mytest_batch_entry* ent)
+{
+    if (ent->reserved)
+        return -EINVAL;
+
+    switch (ent->cmd)
+    {
+    case IOC_MYTEST_PRINT:
+        {
+            /* length is known, so this is a plain copy rather than strncpy_from_user */
+            char buf[135];
+            size_t len = min_t(size_t, ent->len, sizeof(buf) - 1);
+            if (copy_from_user(buf, u64_to_user_ptr(ent->payload), len))
+                return -EFAULT;
+            buf[len] = 0;
+            printk(KERN_ALERT "mytest user print: [%s]\n", buf);
+            return 0;
+        }
+
+    case IOC_MYTEST_SET_RING:
+    case IOC_MYTEST_SET_STAGING:
+    case IOC_MYTEST_SET_COMPRESS:
+    case IOC_MYTEST_SET_FRAMED:
+    case IOC_MYTEST_GET_LOST:
+    case IOC_MYTEST_SET_WAKEUP:
+    case IOC_MYTEST_SET_READ_TIMEOUT:
+        return (int) do_ioctl(filp, ent->cmd, (unsigned long) u64_to_user_ptr(ent->payload));
+
+    default:
+        /* in particular, no nested batches, panics or oopses */
+        return -EINVAL;
+    }
+}
+
+static void call_fs_sync(void)
+{
+    // sys_sync, emergency_sync and syscall table are not exported from kernel
+
+    // emergency_sync();
+    // set_current_state(TASK_UNINTERRUPTIBLE);
+    // schedule_timeout(HZ / 10);
+}
+
+static void free_chunks(struct mytest_dev* dev)
+{
+    size_t k;
+
+    if (dev->pages)
+    {
+        for (k = 0;  k < dev->npages;  k++)
+        {
+            if (dev->pages[k])
+                free_chunk(dev->pages[k]);
+        }
+        kfree(dev->pages);
+        dev->pages = NULL;
+    }
+    dev->npages = 0;
+    dev->buffer_start = 0;
+    dev->buffer_size = 0;
+    dev->ring = false;
+
+    if (dev->hdr_page)
+    {
+        __free_page(dev->hdr_page);
+        dev->hdr_page = NULL;
+    }
+}
+
+/*
+ * Switch between linear mode (writes stop when the window is full) and ring
+ * mode (oldest data is overwritten). Entering ring mode allocates all chunks
+ * up front, so the write path never allocates afterwards. Chunk placement is
+ * the same in both modes, so existing data is kept across the switch.
+ */
+static int set_ring_mode(struct mytest_dev* dev, bool ring)
+{
+    size_t k;
+
+    mutex_lock(& dev->wlock);
+
+    if (ring)
+    {
+        for (k = 0;  k < dev->npages;  k++)
+        {
+            struct page* page;
+
+            if (dev->pages[k])
+                continue;
+
+            page = alloc_chunk(dev, GFP_KERNEL);
+            if (page == NULL)
+            {
+                mutex_unlock(& dev->wlock);
+                return -ENOMEM;
+            }
+            smp_store_release(& dev->pages[k], page);
+        }
+    }
+
+    WRITE_ONCE(dev->ring, ring);
+
+    mutex_unlock(& dev->wlock);
+
+    /* POLLOUT state may have changed */
+    trace_mytest_wakeup(dev->index, READ_ONCE(dev->buffer_size));
+    wake_up_interruptible(&dev->out_wait_q);
+
+    return 0;
+}
+
+/*
+ * Copy [offset, offset + count) out of the chunks, returns number of bytes copied.
+ *
+ * Outside of ring mode data in the window never changes, so chunk pages are
+ * handed to copy_page_to_iter(), which lets splice into a pipe take a reference
+ * to the page instead of copying it. Ring mode chunks get overwritten later,
+ * and so do chunks of archived data with compression on, so there the bytes
+ * are always copied.
+ */
+static size_t copy_chunks_to_iter(struct mytest_dev* dev, struct iov_iter* to, size_t offset, size_t count)
+{
+    bool stable = !READ_ONCE(dev->ring) && !READ_ONCE(dev->compress);
+    size_t done = 0;
+    int idx;
+
+    idx = srcu_read_lock(&chunk_srcu);
+
+    while (done < count)
+    {
+        size_t pgoff = (offset + done) & ~PAGE_MASK;
+        size_t n = min(count - done, (size_t) PAGE_SIZE - pgoff);
+        struct page* page = smp_load_acquire(chunk_slot(dev, offset + done));
+        size_t copied;
+
+        /* trimmed under our feet, the caller sees buffer_start moved */
+        if (page == NULL)
+            break;
+
+        if (stable)
+            copied = copy_page_to_iter(page, pgoff, n, to);
+        else
+            copied = copy_to_iter((const char*) page_address(page) + pgoff, n, to);
+        done += copied;
+        if (copied != n)
+            break;
+    }
+
+    srcu_read_unlock(&chunk_srcu, idx);
+
+    return done;
+}
+
+/*
+ * Per-CPU write staging.
+ *
+ * With 64 producers appending to one device, every write serializes on wlock.
+ * In staging mode a write that fits in MYTEST_STAGE_SIZE is instead copied
+ * into the staging buffer of the CPU the writer runs on, under that buffer's
+ * own lock, which in practice is only ever contended by writers on the same
+ * CPU. A staging buffer is folded into the device as a whole under wlock:
+ *
+ *   - when the next record does not fit into it;
+ *   - when it reaches stage_flush_bytes;
+ *   - when a reader catches up with the published data (read or poll);
+ *   - stage_flush_ms after it went non-empty, from stage_work.
+ *
+ * Ordering: the bytes of one write() are never split or interleaved with other
+ * writes. Records staged on the same CPU reach the device in the order they
+ * were written. Records from different CPUs are ordered by when their staging
+ * buffers get folded, not by when they were written, so a thread that migrates
+ * between CPUs can see its own records reordered. A write that bypasses
+ * staging (too large, or the device is close to full) first folds the current
+ * CPU's buffer, so it stays ordered after records staged on that CPU.
+ */
+static ssize_t stage_write(struct mytest_dev* dev, struct iov_iter* from, bool nowait)
+{
+    struct mytest_stage* st = raw_cpu_ptr(dev->stage);
+    size_t count = iov_iter_count(from);
+    bool was_empty;
+    bool fits;
+    int error;
+
+    error = lock_timed(dev, &st->lock, nowait);
+    if (error)
+        return error;
+
+    /*
+     * Outside of ring mode staged data must still fit once folded in, since the
+     * writer has already been told it was stored. Check against a worst case
+     * of every CPU's buffer being full rather than keeping a shared count.
+     * A write larger than a staging buffer never fits, it goes straight to the
+     * device once this CPU's buffer is folded ahead of it.
+     */
+    fits = count <= MYTEST_STAGE_SIZE &&
+           (READ_ONCE(dev->ring) ||
+            READ_ONCE(dev->buffer_size) - READ_ONCE(dev->buffer_start) +
+            (size_t) num_online_cpus() * MYTEST_STAGE_SIZE <= dev->maxsize);
+
+    if (!fits || st->used + count > MYTEST_STAGE_SIZE)
+    {
+        error = fold_stage(dev, st, nowait);
+        if (error)
+        {
+            mutex_unlock(&st->lock);
+            return error;
+        }
+    }
+
+    if (!fits)
+    {
+        mutex_unlock(&st->lock);
+        return append_iter(dev, from, nowait, false);
+    }
+
+    /* all or nothing, so that a record is never split */
+    if (copy_from_iter(st->buf + st->used, count, from) != count)
+    {
+        mutex_unlock(&st->lock);
+        return -EFAULT;
+    }
+
+    was_empty = (st->used == 0);
+    WRITE_ONCE(st->used, st->used + count);
+
+    if (st->used >= par_stage_flush_bytes)
+        fold_stage(dev, st, nowait);
+    else if (was_empty && !delayed_work_pending(&dev->stage_work))
+        schedule_delayed_work(&dev->stage_work, msecs_to_jiffies(par_stage_flush_ms));
+
+    mutex_unlock(&st->lock);
+
+    return count;
+}
+
+/*
+ * Append the contents of a staging buffer to the device, called with st->lock held.
+ * Returns -EAGAIN or -ERESTARTSYS if the buffer could not be folded right now
+ * and is left as it is. Otherwise the buffer ends up empty, anything that
+ * could not be stored is counted in stage_dropped.
+ */
+static int fold_stage(struct mytest_dev* dev, struct mytest_stage* st, bool nowait)
+{
+    struct kvec kv;
+    struct iov_iter iter;
+    ssize_t ret;
+
+    if (st->used == 0)
+        return 0;
+
+    kv.iov_base = st->buf;
+    kv.iov_len = st->used;
+    iov_iter_kvec(&iter, WRITE | ITER_KVEC, &kv, 1, st->used);
+
+    ret = append_iter(dev, &iter, nowait, false);
+    if (ret == -EAGAIN || ret == -ERESTARTSYS)
+        return ret;
+
+    if (ret < 0)
+        ret = 0;
+    if (ret < st->used)
+        atomic64_add(st->used - ret, &dev->stage_dropped);
+
+    WRITE_ONCE(st->used, 0);
+    return 0;
+}
+
+/*
+ * Fold all CPUs' staging buffers into the device. With nowait, buffers that are
+ * busy right now are skipped.
+ */
+static void flush_stages(struct mytest_dev* dev, bool nowait)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct mytest_stage* st = per_cpu_ptr(dev->stage, cpu);
+
+        if (READ_ONCE(st->used) == 0)
+            continue;
+
+        if (nowait)
+        {
+            if (!mutex_trylock(&st->lock))
+                continue;
+        }
+        else
+        {
+            mutex_lock(&st->lock);
+        }
+
+        fold_stage(dev, st, nowait);
+        mutex_unlock(&st->lock);
+    }
+}
+
+static void stage_work_func(struct work_struct* work)
+{
+    struct mytest_dev* dev = container_of(to_delayed_work(work), struct mytest_dev, stage_work);
+    flush_stages(dev, false);
+}
+
+/*
+ * Staging buffers are allocated the first time staging is enabled and kept
+ * until the device goes away, so a writer that saw staging enabled can always
+ * use them.
+ */
+static int set_staging(struct mytest_dev* dev, bool staging)
+{
+    struct mytest_stage __percpu* stage;
+    int cpu;
+
+    mutex_lock(& dev->wlock);
+
+    /* records cannot be staged, they get their sequence numbers under wlock */
+    if (staging && dev->framed)
+    {
+        mutex_unlock(& dev->wlock);
+        return -EINVAL;
+    }
+
+    if (staging && dev->stage == NULL)
+    {
+        stage = alloc_percpu(struct mytest_stage);
+        if (stage == NULL)
+        {
+            mutex_unlock(& dev->wlock);
+            return -ENOMEM;
+        }
+
+        for_each_possible_cpu(cpu)
+        {
+            struct mytest_stage* st = per_cpu_ptr(stage, cpu);
+            mutex_init(&st->lock);
+            st->used = 0;
+            st->buf = kmalloc_node(MYTEST_STAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+            if (st->buf == NULL)
+            {
+                dev->stage = stage;
+                free_stages(dev);
+                mutex_unlock(& dev->wlock);
+                return -ENOMEM;
+            }
+        }
+
+        dev->stage = stage;
+    }
+
+    /* staging buffers are visible before the flag, pairs with smp_load_acquire() in writers */
+    smp_store_release(& dev->staging, staging);
+
+    mutex_unlock(& dev->wlock);
+
+    /* push out whatever is still staged */
+    if (!staging && dev->stage)
+        flush_stages(dev, false);
+
+    return 0;
+}
+
+static void free_stages(struct mytest_dev* dev)
+{
+    int cpu;
+
+    if (dev->stage == NULL)
+        return;
+
+    for_each_possible_cpu(cpu)
+        kfree(per_cpu_ptr(dev->stage, cpu)->buf);
+
+    free_percpu(dev->stage);
+    dev->stage = NULL;
+    dev->staging = false;
+}
+
+/*
+ * In-kernel search, IOC_MYTEST_SEARCH.
+ *
+ * The range is cut into MYTEST_SEARCH_PIECE pieces, each piece (plus enough
+ * of the next one for a match to finish) is copied out of the chunks into a
+ * contiguous buffer and scanned there. Pieces are worked on in parallel by
+ * kthreads[] (all but the real-time kthreads[0]) and the calling thread, each
+ * recording its own matches, and the caller then merges them in offset order.
+ */
+static long do_search(struct file* filp, struct mytest_search __user* usearch)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev *dev = mf->dev;
+    struct mytest_search sr;
+    struct mytest_search_job* job;
+    char pattern[MYTEST_SEARCH_PATTERN_MAX];
+    char* scratch;
+    __u64 __user* umatches;
+    size_t size;
+    size_t first;
+    size_t line;
+    u64 resume;
+    u64 prev = 0;
+    u32 nout = 0;
+    bool full = false;
+    long per;
+    long k;
+    int error = 0;
+
+    if (copy_from_user(&sr, usearch, sizeof(sr)))
+        return -EFAULT;
+    if (sr.pattern_len == 0 || sr.pattern_len > MYTEST_SEARCH_PATTERN_MAX)
+        return -EINVAL;
+    if (sr.flags & ~MYTEST_SEARCH_LINES)
+        return -EINVAL;
+    if (copy_from_user(pattern, u64_to_user_ptr(sr.pattern), sr.pattern_len))
+        return -EFAULT;
+    umatches = (__u64 __user*) u64_to_user_ptr(sr.matches);
+
+    /* like a read at EOF, make just written data visible */
+    if (smp_load_acquire(& dev->staging))
+        flush_stages(dev, false);
+
+    job = kzalloc(sizeof(*job), GFP_KERNEL);
+    if (job == NULL)
+        return -ENOMEM;
+
+    size = smp_load_acquire(& dev->buffer_size);
+    first = READ_ONCE(dev->buffer_start);
+
+    job->dev = dev;
+    job->pattern = pattern;
+    job->pattern_len = sr.pattern_len;
+    job->lines = (sr.flags & MYTEST_SEARCH_LINES) != 0;
+    job->start = clamp_t(u64, sr.start, first, size);
+    job->data_end = (sr.end == 0 || sr.end > size) ? size : max_t(u64, sr.end, job->start);
+    job->end = max(job->data_end - min(job->data_end, job->pattern_len - 1), job->start);
+
+    /* bound the work and memory of one call, the caller continues from resume */
+    job->npieces = DIV_ROUND_UP(job->end - job->start, MYTEST_SEARCH_PIECE);
+    if (job->npieces > MYTEST_SEARCH_MAX_PIECES)
+    {
+        job->npieces = MYTEST_SEARCH_MAX_PIECES;
+        job->end = job->start + (size_t) MYTEST_SEARCH_MAX_PIECES * MYTEST_SEARCH_PIECE;
+    }
+
+    scratch = vmalloc(MYTEST_SEARCH_PIECE + MYTEST_SEARCH_PATTERN_MAX);
+    if (job->npieces)
+        job->pieces = vzalloc(job->npieces * sizeof(struct mytest_search_piece));
+    if (scratch == NULL || (job->npieces && job->pieces == NULL))
+    {
+        vfree(scratch);
+        vfree(job->pieces);
+        kfree(job);
+        return -ENOMEM;
+    }
+
+    per = DIV_ROUND_UP(job->npieces, MYTEST_SEARCH_NQUEUES);
+    for (k = 0;  k < MYTEST_SEARCH_NQUEUES;  k++)
+    {
+        atomic_long_set(&job->queues[k].next, min(k * per, job->npieces));
+        job->queues[k].limit = min((k + 1) * per, job->npieces);
+    }
+    atomic_long_set(&job->unclaimed, job->npieces);
+    atomic_set(&job->users, 1);
+
+    if (job->npieces > 1)
+    {
+        spin_lock(&search_lock);
+        list_add_tail(&job->link, &search_jobs);
+        spin_unlock(&search_lock);
+        wake_up_all(&search_wait_q);
+    }
+    else
+    {
+        INIT_LIST_HEAD(&job->link);
+    }
+
+    /* the caller works on its own job too, so it completes even with no kthreads around */
+    run_search(job, NTHREADS, scratch);
+
+    spin_lock(&search_lock);
+    list_del_init(&job->link);
+    spin_unlock(&search_lock);
+    atomic_dec(&job->users);
+    wait_event(search_done_q, atomic_read(&job->users) == 0);
+
+    /* in ring mode the oldest data may have been overwritten while we were scanning it */
+    smp_rmb();
+    first = max_t(size_t, READ_ONCE(dev->buffer_start), job->start);
+
+    line = job->start;
+    resume = job->end;
+    for (k = 0;  k < job->npieces && !full && !error;  k++)
+    {
+        struct mytest_search_piece* piece = &job->pieces[k];
+        u32 j;
+
+        for (j = 0;  j < piece->nmatches;  j++)
+        {
+            u64 v = (piece->matches[j] == MYTEST_SEARCH_NONE) ? line : piece->matches[j];
+
+            if (v < first)
+            {
+                if (!job->lines)
+                    continue;
+                v = first;
+            }
+
+            if (job->lines && nout && v == prev)
+                continue;
+
+            if (nout == sr.max_matches)
+            {
+                resume = v;
+                full = true;
+                break;
+            }
+
+            if (put_user(v, &umatches[nout]))
+            {
+                error = -EFAULT;
+                break;
+            }
+            prev = v;
+            nout++;
+        }
+
+        if (!full && piece->overflow)
+        {
+            resume = piece->resume;
+            full = true;
+        }
+
+        if (job->lines && piece->last_line != MYTEST_SEARCH_NONE)
+            line = piece->last_line;
+    }
+
+    sr.start = first;
+    sr.end = job->end;
+    sr.nmatches = nout;
+    sr.resume = max_t(u64, resume, first);
+
+    vfree(scratch);
+    vfree(job->pieces);
+    kfree(job);
+
+    if (error)
+        return error;
+    if (copy_to_user(usearch, &sr, sizeof(sr)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/*
+ * Pick a job that still has pieces to hand out and join it.
+ */
+static struct mytest_search_job* get_search_job(void)
+{
+    struct mytest_search_job* job;
+
+    spin_lock(&search_lock);
+    list_for_each_entry(job, &search_jobs, link)
+    {
+        if (atomic_long_read(&job->unclaimed) > 0)
+        {
+            atomic_inc(&job->users);
+            spin_unlock(&search_lock);
+            return job;
+        }
+    }
+    spin_unlock(&search_lock);
+
+    return NULL;
+}
+
+static void put_search_job(struct mytest_search_job* job)
+{
+    /* the job may be freed as soon as users drops to 0, do not touch it after that */
+    atomic_dec(&job->users);
+    wake_up_all(&search_done_q);
+}
+
+/*
+ * Work on pieces of the job until none are left, @self is the thread's own queue.
+ */
+static void run_search(struct mytest_search_job* job, unsigned int self, char* scratch)
+{
+    unsigned int q;
+
+    for (q = 0;  q < MYTEST_SEARCH_NQUEUES;  q++)
+    {
+        struct mytest_search_queue* queue = &job->queues[(self + q) % MYTEST_SEARCH_NQUEUES];
+        long k;
+
+        while (atomic_long_read(&queue->next) < queue->limit)
+        {
+            k = atomic_long_inc_return(&queue->next) - 1;
+            if (k >= queue->limit)
+                break;
+            atomic_long_dec(&job->unclaimed);
+            search_piece(job, k, scratch);
+        }
+    }
+}
+
+static void search_piece(struct mytest_search_job* job, long k, char* scratch)
+{
+    struct mytest_search_piece* piece = &job->pieces[k];
+    size_t lo = job->start + (size_t) k * MYTEST_SEARCH_PIECE;
+    size_t hi = min(lo + MYTEST_SEARCH_PIECE, job->end);
+    size_t len = min(hi + job->pattern_len - 1, job->data_end) - lo;
+    const char* e = scratch + len;
+    const char* p = scratch;
+    const char* m;
+
+    copy_chunks_to_buf(job->dev, scratch, lo, len);
+
+    piece->last_line = MYTEST_SEARCH_NONE;
+
+    while ((m = scan_memmem(p, e - p, job->pattern, job->pattern_len)) != NULL)
+    {
+        if (piece->nmatches == MYTEST_SEARCH_PIECE_MATCHES)
+        {
+            piece->overflow = true;
+            piece->resume = lo + (p - scratch);
+            return;
+        }
+
+        if (job->lines)
+        {
+            /* report where the line begins, MYTEST_SEARCH_NONE if before this piece */
+            const char* q = m;
+            while (q > p && q[-1] != '\n')
+                q--;
+            piece->matches[piece->nmatches++] = (q == scratch) ? MYTEST_SEARCH_NONE : lo + (q - scratch);
+
+            /* the rest of the line is of no interest */
+            p = scan_memchr(m, '\n', e - m);
+            if (p == NULL)
+                break;
+            p++;
+        }
+        else
+        {
+            piece->matches[piece->nmatches++] = lo + (m - scratch);
+            p = m + 1;
+        }
+    }
+
+    if (job->lines)
+    {
+        /* lets the merge tell where a line running into the next piece began */
+        const char* q = scratch + (hi - lo);
+        while (q > scratch && q[-1] != '\n')
+            q--;
+        if (q != scratch)
+            piece->last_line = lo + (q - scratch);
+    }
+}
+
+/*
+ * Copy [offset, offset + count) out of the chunks into a kernel buffer.
+ */
+static void copy_chunks_to_buf(struct mytest_dev* dev, char* buf, size_t offset, size_t count)
+{
+    size_t done = 0;
+    int idx = srcu_read_lock(&chunk_srcu);
+
+    while (done < count)
+    {
+        size_t pgoff = (offset + done) & ~PAGE_MASK;
+        size_t n = min(count - done, PAGE_SIZE - pgoff);
+        struct page* page = smp_load_acquire(chunk_slot(dev, offset + done));
+
+        if (page)
+            memcpy(buf + done, (const char*) page_address(page) + pgoff, n);
+        else
+            memset(buf + done, 0, n);
+
+        done += n;
+    }
+
+    srcu_read_unlock(&chunk_srcu, idx);
+}
+
+/*
+ * memchr() that looks at a word at a time. Kernel code cannot use SIMD
+ * registers without saving the FPU state, so this uses the same has_zero()
+ * trick as strscpy() and the dcache name hashing, which is most of the win
+ * for scanning a buffer in memory.
+ */
+static const char* scan_memchr(const char* p, int c, size_t n)
+{
+    const struct word_at_a_time constants = WORD_AT_A_TIME_CONSTANTS;
+    unsigned long rep = REPEAT_BYTE((u8) c);
+
+    while (n && !IS_ALIGNED((unsigned long) p, sizeof(unsigned long)))
+    {
+        if (*p == (char) c)
+            return p;
+        p++;
+        n--;
+    }
+
+    while (n >= sizeof(unsigned long))
+    {
+        unsigned long w = *(const unsigned long*) p ^ rep;
+        unsigned long bits;
+
+        if (has_zero(w, &bits, &constants))
+        {
+            bits = prep_zero_mask(w, bits, &constants);
+            bits = create_zero_mask(bits);
+            return p + find_zero(bits);
+        }
+
+        p += sizeof(unsigned long);
+        n -= sizeof(unsigned long);
+    }
+
+    while (n)
+    {
+        if (*p == (char) c)
+            return p;
+        p++;
+        n--;
+    }
+
+    return NULL;
+}
+
+static const char* scan_memmem(const char* p, size_t n, const char* pat, size_t plen)
+{
+    while (n >= plen)
+    {
+        const char* q = scan_memchr(p, pat[0], n - plen + 1);
+        if (q == NULL)
+            return NULL;
+        if (memcmp(q + 1, pat + 1, plen - 1) == 0)
+            return q;
+        n -= q + 1 - p;
+        p = q + 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Scheduling latency monitor, along the lines of cyclictest: a SCHED_FIFO
+ * thread pinned to each CPU sleeps until an absolute hrtimer deadline, one
+ * period after the previous one, and records how late it actually got to run.
+ *
+ * Threads follow CPU hotplug: a CPU's thread is stopped before it goes offline
+ * and a new one is started when it comes back, picking up the same statistics.
+ */
+static void latmon_start(void)
+{
+    int ret;
+
+    /* runs latmon_cpu_online() on every CPU that is online now */
+    ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "mytest/latmon:online", latmon_cpu_online, latmon_cpu_offline);
+    if (ret < 0)
+    {
+        printk(KERN_ALERT "mytest: Failed to register latency monitor hotplug state, error: %d\n", ret);
+        return;
+    }
+    latmon_hp_state = ret;
+
+    if (mytest_debugfs)
+        debugfs_create_file("latency", 0644, mytest_debugfs, NULL, &latmon_fops);
+}
+
+/*
+ * A CPU without a monitor thread is simply left out of the statistics, so
+ * neither callback fails and holds up hotplug.
+ */
+static int latmon_cpu_online(unsigned int cpu)
+{
+    struct mytest_latmon* lm = per_cpu_ptr(&latmon, cpu);
+    struct task_struct* task;
+
+    task = kthread_create_on_node(latmon_thread_func, lm, cpu_to_node(cpu), "mytest_lat/%d", cpu);
+    if (IS_ERR(task))
+    {
+        printk(KERN_ALERT "mytest: Failed to create latency monitor thread for cpu %d.\n", cpu);
+        return 0;
+    }
+
+    kthread_bind(task, cpu);
+    WRITE_ONCE(lm->task, task);
+    wake_up_process(task);
+
+    return 0;
+}
+
+static int latmon_cpu_offline(unsigned int cpu)
+{
+    struct mytest_latmon* lm = per_cpu_ptr(&latmon, cpu);
+    struct task_struct* task = lm->task;
+
+    if (task)
+    {
+        WRITE_ONCE(lm->task, NULL);
+        kthread_stop(task);
+    }
+
+    return 0;
+}
+
+static int latmon_thread_func(void* data)
+{
+    struct mytest_latmon* lm = (struct mytest_latmon*) data;
+    struct sched_param sp;
+    ktime_t next;
+    int err;
+
+    sp.sched_priority = min(par_latmon_prio, (unsigned int) MAX_RT_PRIO - 1);
+    err = sched_setscheduler(current, SCHED_FIFO, &sp);
+    if (err)
+        printk(KERN_ALERT "mytest: failed to set latency monitor thread priority, error: %d\n", err);
+
+    next = ktime_get();
+
+    while (!kthread_should_stop())
+    {
+        u64 period_ns = (u64) max(READ_ONCE(par_latmon_period_us), 10u) * NSEC_PER_USEC;
+        unsigned int seq = atomic_read(&latmon_reset_seq);
+        ktime_t now;
+        s64 lat;
+        int bucket;
+
+        next = ktime_add_ns(next, period_ns);
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout_range(&next, 0, HRTIMER_MODE_ABS);
+
+        now = ktime_get();
+        lat = ktime_to_ns(ktime_sub(now, next));
+
+        /* woken up early, by kthread_stop() */
+        if (lat < 0)
+            continue;
+
+        if (seq != lm->reset_seq)
+        {
+            WRITE_ONCE(lm->samples, 0);
+            WRITE_ONCE(lm->overruns, 0);
+            WRITE_ONCE(lm->sum_ns, 0);
+            WRITE_ONCE(lm->max_ns, 0);
+            memset(lm->hist, 0, sizeof(lm->hist));
+            lm->reset_seq = seq;
+        }
+
+        WRITE_ONCE(lm->samples, lm->samples + 1);
+        WRITE_ONCE(lm->sum_ns, lm->sum_ns + lat);
+        if (lat > lm->max_ns)
+            WRITE_ONCE(lm->max_ns, lat);
+        bucket = min(fls64(lat), MYTEST_LAT_BUCKETS - 1);
+        WRITE_ONCE(lm->hist[bucket], lm->hist[bucket] + 1);
+
+        /* do not try to catch up on periods that were missed altogether */
+        if (lat >= period_ns)
+        {
+            WRITE_ONCE(lm->overruns, lm->overruns + div64_u64(lat, period_ns));
+            next = now;
+        }
+    }
+
+    return 0;
+}
+
+static int latmon_open(struct inode* inode, struct file* filp)
+{
+    return single_open(filp, latmon_show, NULL);
+}
+
+/*
+ * Summary line per CPU, then the histogram with a row per latency bucket
+ * and a column per CPU.
+ */
+static int latmon_show(struct seq_file* m, void* v)
+{
+    int cpu;
+    int k;
+
+    seq_printf(m, "# period %u us, wakeup latency in ns\n", READ_ONCE(par_latmon_period_us));
+    seq_printf(m, "# %4s %12s %10s %10s %10s\n", "cpu", "samples", "overruns", "avg", "max");
+
+    for_each_possible_cpu(cpu)
+    {
+        struct mytest_latmon* lm = per_cpu_ptr(&latmon, cpu);
+        u64 samples = READ_ONCE(lm->samples);
+
+        if (lm->task == NULL)
+            continue;
+
+        seq_printf(m, "  %4d %12llu %10llu %10llu %10llu\n", cpu, samples, READ_ONCE(lm->overruns),
+                   samples ? div64_u64(READ_ONCE(lm->sum_ns), samples) : 0, READ_ONCE(lm->max_ns));
+    }
+
+    seq_printf(m, "# %10s", "< ns");
+    for_each_possible_cpu(cpu)
+    {
+        if (per_cpu_ptr(&latmon, cpu)->task)
+            seq_printf(m, " %9s%-3d", "cpu", cpu);
+    }
+    seq_putc(m, '\n');
+
+    for (k = 0;  k < MYTEST_LAT_BUCKETS;  k++)
+    {
+        if (k == MYTEST_LAT_BUCKETS - 1)
+            seq_printf(m, "  %10s", "more");
+        else
+            seq_printf(m, "  %10llu", 1ull << k);
+
+        for_each_possible_cpu(cpu)
+        {
+            struct mytest_latmon* lm = per_cpu_ptr(&latmon, cpu);
+            if (lm->task)
+                seq_printf(m, " %12llu", READ_ONCE(lm->hist[k]));
+        }
+        seq_putc(m, '\n');
+    }
+
+    return 0;
+}
+
+/*
+ * Any write resets the statistics, each monitor thread clears its own on its
+ * next wakeup.
+ */
+static ssize_t latmon_write(struct file* filp, const char __user* buf, size_t count, loff_t* ppos)
+{
+    atomic_inc(&latmon_reset_seq);
+    return count;
+}
+
+/*
+ * debugfs mytest/mytestN/stats: per operation counts, bytes, errors and
+ * latency percentiles since the last reset, then the latency histogram.
+ * Any write resets the statistics.
+ */
+static int stats_open(struct inode* inode, struct file* filp)
+{
+    return single_open(filp, stats_show, inode->i_private);
+}
+
+/* sum up all CPUs' statistics and subtract the ones saved at last reset */
+static void sum_stats(struct mytest_dev* dev, struct mytest_stats* sum)
+{
+    u64* out = (u64*) sum;
+    const u64* base = (const u64*) dev->stats_base;
+    size_t n = sizeof(struct mytest_stats) / sizeof(u64);
+    size_t k;
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for_each_possible_cpu(cpu)
+    {
+        const u64* in = (const u64*) per_cpu_ptr(dev->stats, cpu);
+        for (k = 0;  k < n;  k++)
+            out[k] += READ_ONCE(in[k]);
+    }
+
+    for (k = 0;  k < n;  k++)
+        out[k] -= base[k];
+}
+
+/* value below which a fraction (permille) of the samples fall */
+static u64 opstat_percentile(const struct mytest_opstat* os, unsigned int permille)
+{
+    u64 want = div64_u64(os->count * permille + 999, 1000);
+    u64 seen = 0;
+    unsigned int k;
+
+    for (k = 0;  k < MYTEST_OPSTAT_BUCKETS;  k++)
+    {
+        seen += os->hist[k];
+        if (seen >= want && seen)
+            return k + 1 < MYTEST_OPSTAT_BUCKETS ? opstat_bucket_floor(k + 1) : opstat_bucket_floor(k);
+    }
+
+    return 0;
+}
+
+static int stats_show(struct seq_file* m, void* v)
+{
+    static const char* const names[MYTEST_NOPS] = { "read", "write", "poll", "ioctl" };
+    struct mytest_dev* dev = (struct mytest_dev*) m->private;
+    struct mytest_stats* sum;
+    unsigned int k;
+    int op;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (sum == NULL)
+        return -ENOMEM;
+
+    mutex_lock(&dev->stats_lock);
+    sum_stats(dev, sum);
+    mutex_unlock(&dev->stats_lock);
+
+    seq_printf(m, "# %-6s %12s %8s %14s %10s %10s %10s %10s\n",
+               "op", "count", "errors", "bytes", "avg_ns", "p50_ns", "p99_ns", "p999_ns");
+    for (op = 0;  op < MYTEST_NOPS;  op++)
+    {
+        const struct mytest_opstat* os = &sum->op[op];
+        seq_printf(m, "  %-6s %12llu %8llu %14llu %10llu %10llu %10llu %10llu\n",
+                   names[op], os->count, os->errors, os->bytes,
+                   os->count ? div64_u64(os->total_ns, os->count) : 0,
+                   opstat_percentile(os, 500), opstat_percentile(os, 990), opstat_percentile(os, 999));
+    }
+    seq_printf(m, "lock_waits %llu\nlock_wait_ns %llu\n", sum->lock_waits, sum->lock_wait_ns);
+    seq_printf(m, "stage_dropped %lld\n", (long long) atomic64_read(&dev->stage_dropped));
+    seq_printf(m, "trimmed %lld\n", (long long) atomic64_read(&dev->trimmed));
+    seq_printf(m, "producer_dropped %lld\n", (long long) atomic64_read(&dev->producer_dropped));
+    seq_printf(m, "evicted %lld\n", (long long) atomic64_read(&dev->evicted));
+    seq_printf(m, "node %d\nchunks_local %lld\nchunks_remote %lld\n", READ_ONCE(dev->node),
+               (long long) atomic64_read(&dev->chunks_local), (long long) atomic64_read(&dev->chunks_remote));
+
+    mutex_lock(&dev->zlock);
+    if (dev->zblocks)
+    {
+        seq_printf(m, "archive_start %zu\narchive_blocks %zu\narchive_bytes %zu\narchive_budget %zu\n",
+                   dev->zfirst * MYTEST_ZBLOCK, dev->znext - dev->zfirst, dev->zbytes, dev->zbudget);
+        seq_printf(m, "compress_blocks %llu\ncompress_bytes_in %llu\ncompress_bytes_out %llu\n",
+                   dev->zstats.blocks, dev->zstats.blocks * MYTEST_ZBLOCK, dev->zstats.bytes_out);
+        seq_printf(m, "compress_skipped %llu\ncompress_dropped %llu\nzcache_hits %llu\nzcache_misses %llu\n",
+                   dev->zstats.skipped, dev->zstats.dropped, dev->zstats.cache_hits, dev->zstats.cache_misses);
+    }
+    mutex_unlock(&dev->zlock);
+
+    /* histogram rows that have any samples, labelled with the bucket's lower bound */
+    seq_printf(m, "# %12s", ">= ns");
+    for (op = 0;  op < MYTEST_NOPS;  op++)
+        seq_printf(m, " %12s", names[op]);
+    seq_putc(m, '\n');
+
+    for (k = 0;  k < MYTEST_OPSTAT_BUCKETS;  k++)
+    {
+        if (!sum->op[MYTEST_OP_READ].hist[k] && !sum->op[MYTEST_OP_WRITE].hist[k] &&
+            !sum->op[MYTEST_OP_POLL].hist[k] && !sum->op[MYTEST_OP_IOCTL].hist[k])
+            continue;
+
+        seq_printf(m, "  %12llu", opstat_bucket_floor(k));
+        for (op = 0;  op < MYTEST_NOPS;  op++)
+            seq_printf(m, " %12llu", sum->op[op].hist[k]);
+        seq_putc(m, '\n');
+    }
+
+    kfree(sum);
+    return 0;
+}
+
+/*
+ * Reset by remembering the current totals rather than clearing the per-CPU
+ * counters, which would race with their updates.
+ */
+static ssize_t stats_write(struct file* filp, const char __user* buf, size_t count, loff_t* ppos)
+{
+    struct mytest_dev* dev = (struct mytest_dev*) ((struct seq_file*) filp->private_data)->private;
+    struct mytest_stats* sum;
+    size_t n = sizeof(struct mytest_stats) / sizeof(u64);
+    size_t k;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (sum == NULL)
+        return -ENOMEM;
+
+    mutex_lock(&dev->stats_lock);
+    sum_stats(dev, sum);
+    for (k = 0;  k < n;  k++)
+        ((u64*) dev->stats_base)[k] += ((u64*) sum)[k];
+    mutex_unlock(&dev->stats_lock);
+
+    kfree(sum);
+    return count;
+}
+
+/*
+ * IOC_MYTEST_IPI_BENCH: cross call latency between every pair of CPUs,
+ * cost of a cross call to a growing number of CPUs, and stop_machine() stall.
+ */
+#define MYTEST_IPI_ITERATIONS       100
+#define MYTEST_IPI_MAX_ITERATIONS   10000
+#define MYTEST_STOP_MACHINE_RUNS    16
+
+static DEFINE_MUTEX(ipi_bench_lock);   /* one benchmark at a time, they disturb each other */
+
+struct ipi_row
+{
+    unsigned int         ncpus;
+    unsigned int         iterations;
+    u64*                 samples;       /* [iterations] */
+    u64*                 row;           /* [ncpus], results for the CPU we run on */
+};
+
+static long do_ipi_bench(struct mytest_ipi_bench __user* ubench)
+{
+    struct mytest_ipi_bench b;
+    struct ipi_row r;
+    cpumask_var_t mask;
+    u64* matrix = NULL;
+    u64* broadcast = NULL;
+    u64 t0;
+    unsigned int ncpus;
+    unsigned int k;
+    unsigned int n;
+    int cpu;
+    long error = 0;
+
+    if (copy_from_user(&b, ubench, sizeof(b)))
+        return -EFAULT;
+
+    if (b.iterations == 0)
+        b.iterations = MYTEST_IPI_ITERATIONS;
+    if (b.iterations > MYTEST_IPI_MAX_ITERATIONS)
+        return -EINVAL;
+
+    ncpus = min(b.ncpus, (u32) nr_cpu_ids);
+
+    r.ncpus = ncpus;
+    r.iterations = b.iterations;
+    r.samples = kmalloc_array(max(b.iterations, (u32) MYTEST_STOP_MACHINE_RUNS), sizeof(u64), GFP_KERNEL);
+    if (b.matrix && ncpus)
+        matrix = vzalloc((size_t) ncpus * ncpus * sizeof(u64));
+    if (b.broadcast && ncpus)
+        broadcast = kcalloc(ncpus, sizeof(u64), GFP_KERNEL);
+    if (r.samples == NULL || (b.matrix && ncpus && matrix == NULL) || (b.broadcast && ncpus && broadcast == NULL) ||
+        !zalloc_cpumask_var(&mask, GFP_KERNEL))
+    {
+        kfree(r.samples);
+        vfree(matrix);
+        kfree(broadcast);
+        return -ENOMEM;
+    }
+
+    mutex_lock(&ipi_bench_lock);
+    get_online_cpus();
+
+    /* each row is measured from its own CPU */
+    for (cpu = 0;  matrix && cpu < ncpus;  cpu++)
+    {
+        if (!cpu_online(cpu))
+            continue;
+        if (signal_pending(current))
+        {
+            error = -EINTR;
+            break;
+        }
+        r.row = matrix + (size_t) cpu * ncpus;
+        work_on_cpu(cpu, ipi_bench_row, &r);
+    }
+
+    /* broadcast[n]: call the first n online CPUs other than ourselves */
+    for (n = 1;  broadcast && n < ncpus && !error;  n++)
+    {
+        for (k = 0;  k < b.iterations;  k++)
+        {
+            int self;
+
+            preempt_disable();
+            self = smp_processor_id();
+
+            cpumask_clear(mask);
+            for_each_online_cpu(cpu)
+            {
+                if (cpumask_weight(mask) == n)
+                    break;
+                if (cpu != self && cpu < ncpus)
+                    cpumask_set_cpu(cpu, mask);
+            }
+
+            if (cpumask_weight(mask) < n)
+            {
+                preempt_enable();
+                break;
+            }
+
+            t0 = ktime_get_ns();
+            smp_call_function_many(mask, my_smp_function, NULL, true);
+            r.samples[k] = ktime_get_ns() - t0;
+            preempt_enable();
+        }
+
+        /* fewer than n other CPUs online */
+        if (k < b.iterations)
+            break;
+        broadcast[n] = ipi_median(r.samples, b.iterations);
+    }
+
+    /* whole-system stall, from the caller's point of view */
+    b.stop_machine_ns = 0;
+    b.stop_machine_max_ns = 0;
+    for (k = 0;  k < MYTEST_STOP_MACHINE_RUNS && !error;  k++)
+    {
+        t0 = ktime_get_ns();
+        stop_machine_cpuslocked(my_stop_machine_function, NULL, NULL);
+        r.samples[k] = ktime_get_ns() - t0;
+        b.stop_machine_max_ns = max(b.stop_machine_max_ns, (__u64) r.samples[k]);
+    }
+    if (!error)
+        b.stop_machine_ns = ipi_median(r.samples, MYTEST_STOP_MACHINE_RUNS);
+
+    put_online_cpus();
+    mutex_unlock(&ipi_bench_lock);
+
+    b.ncpus = nr_cpu_ids;
+
+    if (!error && matrix && copy_to_user(u64_to_user_ptr(b.matrix), matrix, (size_t) ncpus * ncpus * sizeof(u64)))
+        error = -EFAULT;
+    if (!error && broadcast && copy_to_user(u64_to_user_ptr(b.broadcast), broadcast, ncpus * sizeof(u64)))
+        error = -EFAULT;
+    if (!error && copy_to_user(ubench, &b, sizeof(b)))
+        error = -EFAULT;
+
+    free_cpumask_var(mask);
+    kfree(r.samples);
+    vfree(matrix);
+    kfree(broadcast);
+
+    return error;
+}
+
+/*
+ * Runs on one CPU via work_on_cpu(), times cross calls from it to every other CPU.
+ */
+static long ipi_bench_row(void* arg)
+{
+    struct ipi_row* r = (struct ipi_row*) arg;
+    int self = raw_smp_processor_id();
+    unsigned int k;
+    int cpu;
+
+    for (cpu = 0;  cpu < r->ncpus;  cpu++)
+    {
+        if (cpu == self || !cpu_online(cpu))
+            continue;
+
+        for (k = 0;  k < r->iterations;  k++)
+        {
+            u64 t0;
+
+            preempt_disable();
+            t0 = ktime_get_ns();
+            smp_call_function_single(cpu, my_smp_function, NULL, 1);
+            r->samples[k] = ktime_get_ns() - t0;
+            preempt_enable();
+        }
+
+        r->row[cpu] = ipi_median(r->samples, r->iterations);
+    }
+
+    return 0;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    u64 x = *(const u64*) a;
+    u64 y = *(const u64*) b;
+    return x < y ? -1 : x > y;
+}
+
+static u64 ipi_median(u64* samples, unsigned int n)
+{
+    sort(samples, n, sizeof(u64), cmp_u64, NULL);
+    return samples[n / 2];
+}
+
+/*
+ * Wakeup thresholds. Every reader has its own wait queue, and a write wakes
+ * only the readers past their IOC_MYTEST_SET_WAKEUP threshold, so consumers
+ * that want data in bulk are not woken for every small record. Readers that
+ * do not set thresholds are woken on any new data, as before.
+ */
+
+/*
+ * Whether the reader is past its threshold with the device holding data up
+ * to size. While some data is pending but not enough, also starts the
+ * max_delay_us clock, and the timer then wakes the reader at the deadline.
+ */
+static bool reader_ready(struct mytest_file* mf, size_t size, u64 now)
+{
+    size_t pos = file_pos(mf);
+    u64 delay = READ_ONCE(mf->wake_delay_ns);
+    u64 since;
+
+    if (pos >= size)
+    {
+        if (READ_ONCE(mf->pending_since))
+            WRITE_ONCE(mf->pending_since, 0);
+        return false;
+    }
+
+    /* data overwritten in ring mode will be skipped by read, it does not count */
+    if (size - max_t(size_t, pos, retained_start(mf->dev)) >= READ_ONCE(mf->wake_bytes))
+        return true;
+
+    if (delay == 0)
+        return false;
+
+    since = READ_ONCE(mf->pending_since);
+    if (since == 0)
+    {
+        if (cmpxchg64(&mf->pending_since, 0, now) == 0)
+            hrtimer_start(&mf->wake_timer, ns_to_ktime(now + delay), HRTIMER_MODE_ABS);
+        return false;
+    }
+
+    return now - since >= delay;
+}
+
+/*
+ * Called by writers after publishing new data. Of the ready readers flagged
+ * MYTEST_WAKEUP_EXCLUSIVE only one is woken, and it moves to the end of the
+ * list so that the pool members take turns.
+ */
+static void wake_readers(struct mytest_dev* dev)
+{
+    struct mytest_file* mf;
+    struct mytest_file* pooled = NULL;
+    size_t size = smp_load_acquire(& dev->buffer_size);
+    u64 now = ktime_get_ns();
+
+    trace_mytest_wakeup(dev->index, size);
+
+    /* pairs with the barrier after queueing in poll_wait()/prepare_to_wait(), see waitqueue_active() */
+    smp_mb();
+
+    spin_lock(&dev->files_lock);
+
+    list_for_each_entry(mf, &dev->files, link)
+    {
+        if (!waitqueue_active(&mf->wait_q) || !reader_ready(mf, size, now))
+            continue;
+
+        if (READ_ONCE(mf->wake_exclusive))
+        {
+            if (pooled == NULL)
+                pooled = mf;
+            continue;
+        }
+
+        wake_up_interruptible(&mf->wait_q);
+    }
+
+    if (pooled)
+    {
+        wake_up_interruptible(&pooled->wait_q);
+        list_move_tail(&pooled->link, &dev->files);
+    }
+
+    spin_unlock(&dev->files_lock);
+}
+
+static enum hrtimer_restart wake_timer_func(struct hrtimer* timer)
+{
+    struct mytest_file* mf = container_of(timer, struct mytest_file, wake_timer);
+
+    wake_up_interruptible(&mf->wait_q);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * IOC_MYTEST_SET_WAKEUP. A threshold above the device size could never be
+ * reached, so it is clamped to maxsize.
+ */
+static int set_wakeup(struct mytest_file* mf, const struct mytest_wakeup __user* arg)
+{
+    struct mytest_wakeup w;
+
+    if (copy_from_user(&w, arg, sizeof(w)))
+        return -EFAULT;
+
+    if ((w.flags & ~MYTEST_WAKEUP_EXCLUSIVE) || w.reserved)
+        return -EINVAL;
+
+    WRITE_ONCE(mf->wake_bytes, clamp_t(size_t, w.min_bytes, 1, mf->dev->maxsize));
+    WRITE_ONCE(mf->wake_delay_ns, (u64) w.max_delay_us * NSEC_PER_USEC);
+    WRITE_ONCE(mf->wake_exclusive, (w.flags & MYTEST_WAKEUP_EXCLUSIVE) != 0);
+
+    hrtimer_cancel(&mf->wake_timer);
+    WRITE_ONCE(mf->pending_since, 0);
+
+    /* a lower threshold may already be met */
+    wake_readers(mf->dev);
+
+    return 0;
+}
+
+/*
+ * Compressed archive. Log-like data compresses several times over, so with
+ * compression on a device retains history beyond its window: shortly before a
+ * block of MYTEST_ZBLOCK bytes leaves the window, a kthread compresses it with
+ * LZ4 into the archive, and reads that fall below buffer_start are served from
+ * there. The uncompressed window itself is unchanged, so writers, mmap and
+ * search work as before.
+ *
+ * The archive holds at most zbudget compressed bytes. Blocks are not archived
+ * as soon as they are written, or the budget would mostly go to copies of data
+ * the window still has: only the last stretch of the window before data
+ * leaves it (see archive_limit()) is held twice, so the budget buys roughly
+ * its size times the compression ratio of extra history.
+ */
+
+static int set_compress(struct mytest_dev* dev, bool compress)
+{
+    int k;
+
+    mutex_lock(& dev->wlock);
+    mutex_lock(&dev->zlock);
+
+    /* archive blocks do not follow record boundaries */
+    if (compress && dev->framed)
+    {
+        mutex_unlock(&dev->zlock);
+        mutex_unlock(& dev->wlock);
+        return -EINVAL;
+    }
+
+    if (compress && dev->zblocks == NULL)
+    {
+        size_t budget = READ_ONCE(par_compress_budget);
+
+        dev->zbudget = max_t(size_t, budget ? budget : dev->maxsize / 4, 2 * MYTEST_ZBLOCK);
+        /* enough descriptors for 32x compression, beyond that blocks get dropped early */
+        dev->zcap = max_t(size_t, dev->zbudget / (MYTEST_ZBLOCK / 32), 16);
+        dev->zblocks = kvzalloc(dev->zcap * sizeof(struct mytest_zblock), GFP_KERNEL);
+        if (dev->zblocks == NULL)
+        {
+            mutex_unlock(&dev->zlock);
+            mutex_unlock(& dev->wlock);
+            return -ENOMEM;
+        }
+
+        /* the first block must still be complete in the window */
+        dev->zfirst = dev->znext = DIV_ROUND_UP(dev->buffer_start, MYTEST_ZBLOCK);
+        dev->zbytes = 0;
+        for (k = 0;  k < MYTEST_ZCACHE;  k++)
+            dev->zcache[k].block = MYTEST_ZNONE;
+    }
+    else if (!compress)
+    {
+        free_archive(dev);
+    }
+
+    WRITE_ONCE(dev->compress, compress);
+
+    mutex_unlock(&dev->zlock);
+    mutex_unlock(& dev->wlock);
+
+    if (compress)
+        queue_compress(dev);
+
+    return 0;
+}
+
+/* caller holds zlock, or is the last user of the device */
+static void free_archive(struct mytest_dev* dev)
+{
+    size_t b;
+    int k;
+
+    if (dev->zblocks)
+    {
+        for (b = dev->zfirst;  b < dev->znext;  b++)
+            kfree(dev->zblocks[b % dev->zcap].data);
+        kvfree(dev->zblocks);
+        dev->zblocks = NULL;
+    }
+    dev->zfirst = dev->znext = 0;
+    dev->zbytes = 0;
+
+    for (k = 0;  k < MYTEST_ZCACHE;  k++)
+    {
+        vfree(dev->zcache[k].data);
+        dev->zcache[k].data = NULL;
+        dev->zcache[k].block = MYTEST_ZNONE;
+        dev->zcache[k].used = 0;
+    }
+}
+
+/*
+ * Hand the device to kthreads[]. A queued device holds a reference, so it
+ * stays around until a kthread (or module unload) takes it off the queue.
+ */
+static void queue_compress(struct mytest_dev* dev)
+{
+    bool queued = false;
+
+    spin_lock(&compress_lock);
+    if (list_empty(&dev->zlink))
+    {
+        kref_get(&dev->ref);
+        list_add_tail(&dev->zlink, &compress_queue);
+        queued = true;
+    }
+    spin_unlock(&compress_lock);
+
+    if (queued)
+        wake_up_all(&search_wait_q);
+}
+
+/*
+ * Take the first device on the given node off the queue, or the first one
+ * at all if there is none, so that nodes without a compressing thread are
+ * served too. NUMA_NO_NODE takes the first device.
+ */
+static struct mytest_dev* get_compress_dev(int node)
+{
+    struct mytest_dev* dev = NULL;
+    struct mytest_dev* d;
+
+    spin_lock(&compress_lock);
+    list_for_each_entry(d, &compress_queue, zlink)
+    {
+        if (dev == NULL)
+            dev = d;
+        if (node == NUMA_NO_NODE || READ_ONCE(d->node) == node)
+        {
+            dev = d;
+            break;
+        }
+    }
+    if (dev)
+        list_del_init(&dev->zlink);
+    spin_unlock(&compress_lock);
+
+    return dev;
+}
+
+/*
+ * Archive up to MYTEST_ZBATCH blocks of the device that are about to leave
+ * the window, see archive_limit(). Returns true if more are ready.
+ *
+ * A block is copied out of the window and the copy validated against
+ * buffer_start the same way readers do. In ring mode the writer can outrun
+ * the compressor, a block overwritten before it got here is recorded as
+ * a hole. Outside of ring mode the writer only moves buffer_start over
+ * archived blocks, so there are no holes; once the budget is used up the
+ * archive stops growing and the window fills up as it would without it.
+ */
+static bool compress_blocks(struct mytest_dev* dev, struct my_thread_struct* t)
+{
+    bool more = false;
+    bool archived = false;
+    int k;
+
+    mutex_lock(&dev->zlock);
+
+    for (k = 0;  k < MYTEST_ZBATCH;  k++)
+    {
+        size_t b = dev->znext;
+        size_t offset = b * MYTEST_ZBLOCK;
+        struct mytest_zblock* zb;
+        const char* src = t->m_zbuf;
+        void* data = NULL;
+        int len = 0;
+
+        if (!dev->compress || offset + MYTEST_ZBLOCK > archive_limit(dev, smp_load_acquire(& dev->buffer_size)))
+            break;
+
+        if (offset >= READ_ONCE(dev->buffer_start))
+        {
+            copy_chunks_to_buf(dev, t->m_scratch, offset, MYTEST_ZBLOCK);
+            smp_rmb();
+        }
+
+        if (offset >= READ_ONCE(dev->buffer_start))
+        {
+            len = LZ4_compress_default(t->m_scratch, t->m_zbuf, MYTEST_ZBLOCK,
+                                       LZ4_COMPRESSBOUND(MYTEST_ZBLOCK), t->m_zwork);
+            if (len <= 0 || len >= MYTEST_ZBLOCK)
+            {
+                /* incompressible */
+                len = MYTEST_ZBLOCK;
+                src = t->m_scratch;
+            }
+        }
+
+        /* make room, only ring mode may give up old data */
+        while (dev->zfirst < dev->znext &&
+               (dev->znext - dev->zfirst >= dev->zcap || dev->zbytes + len > dev->zbudget))
+        {
+            if (!READ_ONCE(dev->ring))
+                goto out;
+
+            drop_archive_block(dev);
+            dev->zstats.dropped++;
+        }
+
+        if (len)
+        {
+            data = kmalloc(len, GFP_KERNEL | __GFP_NOWARN);
+            if (data == NULL)
+                break;
+            memcpy(data, src, len);
+            dev->zstats.blocks++;
+            dev->zstats.bytes_out += len;
+        }
+        else
+        {
+            dev->zstats.skipped++;
+        }
+
+        zb = &dev->zblocks[b % dev->zcap];
+        zb->data = data;
+        zb->len = len;
+        dev->zbytes += len;
+
+        /* pairs with smp_load_acquire() in append_iter() */
+        smp_store_release(& dev->znext, b + 1);
+        archived = true;
+    }
+
+    more = k == MYTEST_ZBATCH;
+
+out:
+    mutex_unlock(&dev->zlock);
+
+    /* outside of ring mode, archived data makes room for writers */
+    if (archived && !READ_ONCE(dev->ring))
+        wake_up_interruptible(&dev->out_wait_q);
+
+    return more;
+}
+
+/*
+ * Copy data that has left the window out of the archive. Moves *offset past
+ * whatever the archive no longer has (trimmed, or a hole) and accounts it in
+ * *lost. Returns the number of bytes copied, 0 if *offset is not archived,
+ * or an error.
+ */
+static ssize_t read_archive(struct mytest_dev* dev, struct iov_iter* to, size_t* offset, size_t count,
+                            atomic64_t* lost, bool nowait)
+{
+    const struct mytest_zblock* zb;
+    const char* data;
+    size_t boff;
+    size_t copied;
+    size_t b;
+
+    if (nowait)
+    {
+        if (!mutex_trylock(&dev->zlock))
+            return -EAGAIN;
+    }
+    else
+    {
+        mutex_lock(&dev->zlock);
+    }
+
+    if (dev->zblocks == NULL || dev->zfirst == dev->znext)
+    {
+        mutex_unlock(&dev->zlock);
+        return 0;
+    }
+
+    if (*offset < dev->zfirst * MYTEST_ZBLOCK)
+    {
+        atomic64_add(dev->zfirst * MYTEST_ZBLOCK - *offset, lost);
+        *offset = dev->zfirst * MYTEST_ZBLOCK;
+    }
+
+    for (;;)
+    {
+        b = *offset / MYTEST_ZBLOCK;
+        if (b >= dev->znext)
+        {
+            mutex_unlock(&dev->zlock);
+            return 0;
+        }
+
+        zb = &dev->zblocks[b % dev->zcap];
+        if (zb->data)
+            break;
+
+        atomic64_add((b + 1) * MYTEST_ZBLOCK - *offset, lost);
+        *offset = (b + 1) * MYTEST_ZBLOCK;
+    }
+
+    data = zb->len == MYTEST_ZBLOCK ? (const char*) zb->data : zcache_get(dev, b, zb);
+    if (data == NULL)
+    {
+        mutex_unlock(&dev->zlock);
+        return -ENOMEM;
+    }
+
+    boff = *offset % MYTEST_ZBLOCK;
+    copied = copy_to_iter(data + boff, min(count, MYTEST_ZBLOCK - boff), to);
+
+    mutex_unlock(&dev->zlock);
+
+    return copied ? copied : -EFAULT;
+}
+
+/*
+ * Decompressed contents of archived block b, from the cache or decompressed
+ * into its least recently used entry. Caller holds zlock.
+ */
+static const char* zcache_get(struct mytest_dev* dev, size_t b, const struct mytest_zblock* zb)
+{
+    struct mytest_zcache* victim = &dev->zcache[0];
+    int k;
+
+    for (k = 0;  k < MYTEST_ZCACHE;  k++)
+    {
+        struct mytest_zcache* zc = &dev->zcache[k];
+
+        if (zc->block == b)
+        {
+            zc->used = ++dev->zclock;
+            dev->zstats.cache_hits++;
+            return zc->data;
+        }
+
+        if (zc->used < victim->used)
+            victim = zc;
+    }
+
+    dev->zstats.cache_misses++;
+
+    if (victim->data == NULL)
+    {
+        victim->data = vmalloc(MYTEST_ZBLOCK);
+        if (victim->data == NULL)
+            return NULL;
+    }
+
+    victim->block = MYTEST_ZNONE;
+    if (LZ4_decompress_safe(zb->data, victim->data, zb->len, MYTEST_ZBLOCK) != MYTEST_ZBLOCK)
+    {
+        printk(KERN_ALERT "mytest: corrupt archive block %zu\n", b);
+        return NULL;
+    }
+
+    victim->block = b;
+    victim->used = ++dev->zclock;
+    return victim->data;
+}
+
+/* stream offset of the oldest byte a read can still return */
+static size_t retained_start(struct mytest_dev* dev)
+{
+    size_t start = READ_ONCE(dev->buffer_start);
+
+    if (READ_ONCE(dev->compress) && READ_ONCE(dev->zfirst) < READ_ONCE(dev->znext))
+        start = min(start, READ_ONCE(dev->zfirst) * MYTEST_ZBLOCK);
+
+    return start;
+}
+
+/*
+ * End of the data that may be archived when the device holds size bytes:
+ * whatever a full window would drop within the next lead bytes written.
+ * In ring mode that gives the compressor lead bytes of writes to get to a
+ * block before it is overwritten, outside of ring mode it keeps that much
+ * room ready for a writer that finds the window full.
+ */
+static size_t archive_limit(struct mytest_dev* dev, size_t size)
+{
+    size_t maxsize = READ_ONCE(dev->maxsize);
+    size_t lead = min_t(size_t, max_t(size_t, maxsize / 8, MYTEST_ZLEAD_MIN), maxsize);
+
+    return size + lead > maxsize ? size + lead - maxsize : 0;
+}
+
+/* caller holds zlock */
+static void drop_archive_block(struct mytest_dev* dev)
+{
+    struct mytest_zblock* zb = &dev->zblocks[dev->zfirst % dev->zcap];
+
+    kfree(zb->data);
+    dev->zbytes -= zb->len;
+    zb->data = NULL;
+    zb->len = 0;
+    WRITE_ONCE(dev->zfirst, dev->zfirst + 1);
+}
+
+/*
+ * Consumer groups. Each group is a cursor kept by the device, and once every
+ * group has read past some data, trim_work_func() drops it from the window
+ * and frees its chunks. Readers copy out of chunks without locks, so freed
+ * chunk pages are released only after an SRCU grace period (chunk_srcu);
+ * a reader that finds a chunk gone sees buffer_start moved past it and
+ * accounts the bytes as lost, just like with ring mode overwrites.
+ */
+
+/* position the file reads next, for wakeup thresholds */
+static size_t file_pos(struct mytest_file* mf)
+{
+    struct mytest_consumer_group* g;
+    size_t pos;
+
+    rcu_read_lock();
+    g = READ_ONCE(mf->group);
+    pos = g ? READ_ONCE(g->cursor) : READ_ONCE(mf->filp->f_pos);
+    rcu_read_unlock();
+
+    return pos;
+}
+
+/*
+ * The file's group with its lock held, NULL if the file is not in a group,
+ * or an error. groups_lock keeps the file from leaving the group and the
+ * group from being deleted until the group lock is taken.
+ */
+static struct mytest_consumer_group* lock_group(struct mytest_file* mf, bool nowait)
+{
+    struct mytest_dev* dev = mf->dev;
+    struct mytest_consumer_group* g;
+    int error;
+
+    if (READ_ONCE(mf->group) == NULL)
+        return NULL;
+
+    error = lock_timed(dev, &dev->groups_lock, nowait);
+    if (error)
+        return ERR_PTR(error);
+
+    g = mf->group;
+    if (g)
+    {
+        error = lock_timed(dev, &g->lock, nowait);
+        if (error)
+            g = ERR_PTR(error);
+    }
+
+    mutex_unlock(&dev->groups_lock);
+
+    return g;
+}
+
+/* caller holds groups_lock */
+static struct mytest_consumer_group* find_group(struct mytest_dev* dev, const char* name)
+{
+    struct mytest_consumer_group* g;
+
+    list_for_each_entry(g, &dev->groups, link)
+    {
+        if (0 == strcmp(g->name, name))
+            return g;
+    }
+
+    return NULL;
+}
+
+static int copy_group_from_user(struct mytest_group* req, const struct mytest_group __user* ugroup)
+{
+    size_t len;
+
+    if (copy_from_user(req, ugroup, sizeof(*req)))
+        return -EFAULT;
+
+    len = strnlen(req->name, sizeof(req->name));
+    if (len == 0 || len == sizeof(req->name))
+        return -EINVAL;
+
+    if ((req->flags & ~(MYTEST_GROUP_CREATE | MYTEST_GROUP_AT_END)) || req->reserved)
+        return -EINVAL;
+
+    return 0;
+}
+
+static int join_group(struct mytest_file* mf, struct mytest_group __user* ugroup)
+{
+    struct mytest_dev* dev = mf->dev;
+    struct mytest_consumer_group* g;
+    struct mytest_group req;
+    int error;
+
+    error = copy_group_from_user(&req, ugroup);
+    if (error)
+        return error;
+
+    mutex_lock(&dev->groups_lock);
+
+    if (mf->group)
+    {
+        mutex_unlock(&dev->groups_lock);
+        return -EBUSY;
+    }
+
+    g = find_group(dev, req.name);
+    if (g == NULL)
+    {
+        if (!(req.flags & MYTEST_GROUP_CREATE))
+            error = -ENOENT;
+        else if (dev->ngroups >= MYTEST_GROUP_MAX)
+            error = -ENOSPC;
+        else if ((g = kzalloc(sizeof(*g), GFP_KERNEL)) == NULL)
+            error = -ENOMEM;
+
+        if (error)
+        {
+            mutex_unlock(&dev->groups_lock);
+            return error;
+        }
+
+        memcpy(g->name, req.name, sizeof(g->name));
+        mutex_init(&g->lock);
+        if (req.flags & MYTEST_GROUP_AT_END)
+            g->cursor = smp_load_acquire(& dev->buffer_size);
+        else
+            g->cursor = retained_start(dev);
+        list_add_tail(&g->link, &dev->groups);
+        dev->ngroups++;
+    }
+
+    g->members++;
+    WRITE_ONCE(mf->group, g);
+    req.cursor = READ_ONCE(g->cursor);
+
+    mutex_unlock(&dev->groups_lock);
+
+    if (put_user(req.cursor, &ugroup->cursor))
+        return -EFAULT;
+
+    /* the group's data may be ready already */
+    wake_readers(dev);
+
+    return 0;
+}
+
+/* the file continues on its own from the group cursor */
+static int leave_group(struct mytest_file* mf)
+{
+    struct mytest_dev* dev = mf->dev;
+    struct mytest_consumer_group* g;
+
+    mutex_lock(&dev->groups_lock);
+
+    g = mf->group;
+    if (g == NULL)
+    {
+        mutex_unlock(&dev->groups_lock);
+        return -EINVAL;
+    }
+
+    mf->filp->f_pos = READ_ONCE(g->cursor);
+    g->members--;
+    WRITE_ONCE(mf->group, NULL);
+
+    mutex_unlock(&dev->groups_lock);
+
+    return 0;
+}
+
+static int delete_group(struct mytest_dev* dev, const struct mytest_group __user* ugroup)
+{
+    struct mytest_consumer_group* g;
+    struct mytest_group req;
+    int error;
+
+    error = copy_group_from_user(&req, ugroup);
+    if (error)
+        return error;
+
+    mutex_lock(&dev->groups_lock);
+
+    g = find_group(dev, req.name);
+    if (g == NULL || g->members)
+    {
+        mutex_unlock(&dev->groups_lock);
+        return g ? -EBUSY : -ENOENT;
+    }
+
+    list_del(&g->link);
+    dev->ngroups--;
+
+    /* a member that left meanwhile may still be in the middle of a read */
+    mutex_lock(&g->lock);
+    mutex_unlock(&g->lock);
+
+    mutex_unlock(&dev->groups_lock);
+
+    /* file_pos() may still be looking at it */
+    kfree_rcu(g, rcu);
+
+    /* the group no longer holds its data */
+    schedule_work(&dev->trim_work);
+
+    return 0;
+}
+
+/*
+ * Drop the data every group has read. Outside of ring mode the window start
+ * moves up to the slowest group cursor and chunks wholly below it are freed;
+ * ring mode chunks are preallocated and overwritten in place, so there only
+ * archived blocks are freed.
+ */
+static void trim_work_func(struct work_struct* work)
+{
+    struct mytest_dev* dev = container_of(work, struct mytest_dev, trim_work);
+    struct mytest_consumer_group* g;
+    struct page* page;
+    struct page* tmp;
+    LIST_HEAD(freelist);
+    size_t low = SIZE_MAX;
+    size_t start;
+    size_t k;
+
+    /* groups_lock keeps groups from being created behind the cursors checked here */
+    mutex_lock(&dev->groups_lock);
+
+    list_for_each_entry(g, &dev->groups, link)
+        low = min(low, READ_ONCE(g->cursor));
+
+    if (low == SIZE_MAX)
+    {
+        /* without groups nobody says what has been consumed */
+        mutex_unlock(&dev->groups_lock);
+        return;
+    }
+
+    mutex_lock(& dev->wlock);
+
+    start = dev->buffer_start;
+    low = min(low, dev->buffer_size);
+
+    if (!dev->ring && low > start)
+    {
+        WRITE_ONCE(dev->buffer_start, low);
+        WRITE_ONCE(mmap_header(dev)->data_start, low);
+        smp_wmb();
+
+        for (k = start >> PAGE_SHIFT;  k < (low >> PAGE_SHIFT);  k++)
+        {
+            struct page** slot = chunk_slot(dev, k << PAGE_SHIFT);
+
+            if (*slot)
+            {
+                list_add(&(*slot)->lru, &freelist);
+                WRITE_ONCE(*slot, NULL);
+                atomic64_add(PAGE_SIZE, &dev->trimmed);
+            }
+        }
+    }
+
+    mutex_unlock(& dev->wlock);
+
+    mutex_lock(&dev->zlock);
+    if (dev->zblocks)
+    {
+        while (dev->zfirst < dev->znext && (dev->zfirst + 1) * MYTEST_ZBLOCK <= low)
+            drop_archive_block(dev);
+
+        /* nothing left to archive below the groups either */
+        if (dev->znext < DIV_ROUND_UP(low, MYTEST_ZBLOCK) && dev->zfirst == dev->znext)
+        {
+            dev->zfirst = DIV_ROUND_UP(low, MYTEST_ZBLOCK);
+            smp_store_release(& dev->znext, dev->zfirst);
+        }
+    }
+    mutex_unlock(&dev->zlock);
+
+    mutex_unlock(&dev->groups_lock);
+
+    if (!list_empty(&freelist))
+    {
+        synchronize_srcu(&chunk_srcu);
+        list_for_each_entry_safe(page, tmp, &freelist, lru)
+        {
+            list_del(&page->lru);
+            free_chunk(page);
+        }
+
+        /* room for writers */
+        wake_up_interruptible(&dev->out_wait_q);
+    }
+}
+
+/* device is going away, nobody is attached */
+static void free_groups(struct mytest_dev* dev)
+{
+    struct mytest_consumer_group* g;
+    struct mytest_consumer_group* tmp;
+
+    list_for_each_entry_safe(g, tmp, &dev->groups, link)
+    {
+        list_del(&g->link);
+        kfree(g);
+    }
+    dev->ngroups = 0;
+}
+
+static int groups_open(struct inode* inode, struct file* filp)
+{
+    return single_open(filp, groups_show, inode->i_private);
+}
+
+static int groups_show(struct seq_file* m, void* v)
+{
+    struct mytest_dev* dev = (struct mytest_dev*) m->private;
+    struct mytest_consumer_group* g;
+
+    seq_printf(m, "# %-*s %20s %8s\n", MYTEST_GROUP_NAME_MAX - 1, "group", "cursor", "members");
+
+    mutex_lock(&dev->groups_lock);
+    list_for_each_entry(g, &dev->groups, link)
+        seq_printf(m, "  %-*s %20zu %8u\n", MYTEST_GROUP_NAME_MAX - 1, g->name, READ_ONCE(g->cursor), g->members);
+    mutex_unlock(&dev->groups_lock);
+
+    return 0;
+}
+
+/*
+ * Data chunk allocation. Writers allocate chunks under wlock, and a plain
+ * alloc_page() there goes into direct reclaim and compaction under memory
+ * pressure, stalling every writer of the device, and may then fail anyway.
+ * mempool_alloc() first tries the page allocator without reclaim, then falls
+ * back on the reserve, and only then reclaims or waits for chunks to be
+ * freed, so writes keep going while the reserve lasts. Chunks are mapped to
+ * user space by mmap, so they are whole pages rather than slab objects.
+ */
+
+/*
+ * Zeroed, since the whole page becomes visible through mmap.
+ *
+ * A device with a node first asks for a free page on that node. The reserve
+ * is shared and not per node, so under memory pressure chunks can come from
+ * other nodes; chunks_remote shows how often that happened.
+ */
+static struct page* alloc_chunk(struct mytest_dev* dev, gfp_t gfp)
+{
+    int node = READ_ONCE(dev->node);
+    struct page* page = NULL;
+
+    if (node != NUMA_NO_NODE)
+    {
+        page = alloc_pages_node(node, (gfp & ~__GFP_DIRECT_RECLAIM) | __GFP_THISNODE | __GFP_NOWARN, 0);
+        if (page)
+            atomic64_inc(&chunk_stats.from_buddy);
+    }
+
+    if (page == NULL)
+        page = mempool_alloc(chunk_pool, gfp);
+
+    if (page == NULL)
+    {
+        atomic64_inc(&chunk_stats.failed);
+        return NULL;
+    }
+
+    if (page_to_nid(page) == (node != NUMA_NO_NODE ? node : numa_node_id()))
+        atomic64_inc(&dev->chunks_local);
+    else
+        atomic64_inc(&dev->chunks_remote);
+
+    clear_page(page_address(page));
+    atomic64_inc(&chunk_stats.allocs);
+    atomic64_inc(&chunk_stats.in_use);
+    return page;
+}
+
+/* NUMA_NO_NODE, or a node with memory */
+static bool valid_node(int node)
+{
+    return node == NUMA_NO_NODE || (node >= 0 && node < nr_node_ids && node_state(node, N_MEMORY));
+}
+
+/* node for kthreads[k], round robin over the online nodes */
+static int thread_node(unsigned int k)
+{
+    unsigned int n;
+    int node;
+
+    if (num_online_nodes() < 2)
+        return NUMA_NO_NODE;
+
+    n = k % num_online_nodes();
+    for_each_online_node(node)
+    {
+        if (n-- == 0)
+            return node;
+    }
+
+    return NUMA_NO_NODE;
+}
+
+/*
+ * A chunk still mapped by a process or held by a pipe must not go into
+ * the reserve and get reused meanwhile, only our reference is dropped then.
+ * Callers make sure no new references can be taken (device gone, or chunk
+ * unpublished and an SRCU grace period passed).
+ */
+static void free_chunk(struct page* page)
+{
+    atomic64_inc(&chunk_stats.frees);
+    atomic64_dec(&chunk_stats.in_use);
+
+    if (page_count(page) == 1)
+        mempool_free(page, chunk_pool);
+    else
+        put_page(page);
+}
+
+static void* chunk_pool_alloc(gfp_t gfp, void* data)
+{
+    struct page* page = alloc_page(gfp);
+
+    if (page)
+        atomic64_inc(&chunk_stats.from_buddy);
+    return page;
+}
+
+static void chunk_pool_free(void* element, void* data)
+{
+    __free_page((struct page*) element);
+}
+
+static int chunks_open(struct inode* inode, struct file* filp)
+{
+    return single_open(filp, chunks_show, inode->i_private);
+}
+
+/*
+ * reserve_used counts allocations the page allocator could not satisfy
+ * without reclaim; if reserve_free often drops to 0, chunk_reserve is too small.
+ */
+static int chunks_show(struct seq_file* m, void* v)
+{
+    s64 allocs = atomic64_read(&chunk_stats.allocs);
+
+    seq_printf(m, "reserve %d\nreserve_free %d\n", chunk_pool->min_nr, READ_ONCE(chunk_pool->curr_nr));
+    seq_printf(m, "allocs %lld\nreserve_used %lld\nfailed %lld\nfrees %lld\nin_use %lld\nshrunk %lld\n",
+               (long long) allocs,
+               (long long) max_t(s64, allocs - atomic64_read(&chunk_stats.from_buddy), 0),
+               (long long) atomic64_read(&chunk_stats.failed),
+               (long long) atomic64_read(&chunk_stats.frees),
+               (long long) atomic64_read(&chunk_stats.in_use),
+               (long long) atomic64_read(&chunk_stats.shrunk));
+    return 0;
+}
+
+/*
+ * In-kernel producers. mytest_append() copies a record into a per-CPU buffer
+ * of the device, reserving room with a cmpxchg, so it never sleeps or spins
+ * on a lock and is safe in hard IRQ and NMI context. The first record in a
+ * buffer kicks an irq_work, which schedules producer_work, which appends the
+ * buffered records to the device from process context.
+ *
+ * Each CPU has two buffers. The drainer switches producers on that CPU over
+ * to the other buffer, closes the old one (so a producer that still saw it
+ * as active retries), and waits for the copies into it that are already
+ * under way; those run with preemption off and finish promptly.
+ *
+ * A record is never split, neither between buffers nor when it is stored: one
+ * the device has no room for is dropped whole and counted in producer_dropped.
+ * Records from one CPU reach the device in order, records from different
+ * CPUs as their buffers get drained. In a buffer each record is preceded by
+ * its length as u32 and padded to a multiple of 4 bytes, so in framed mode it
+ * becomes a record of its own.
+ */
+
+int mytest_append(unsigned int index, const void* data, size_t len)
+{
+    struct mytest_dev** devs;
+    struct mytest_dev* dev;
+    struct mytest_producer* p;
+    struct mytest_pbuf* b;
+    size_t need = ALIGN(sizeof(u32) + len, sizeof(u32));
+    int old;
+
+    if (len == 0 || len > MYTEST_PRODUCER_SIZE - sizeof(u32))
+        return len ? -EMSGSIZE : 0;
+
+    if (index >= par_max_devices)
+        return -ENODEV;
+
+    rcu_read_lock();
+
+    devs = rcu_dereference(mytest_devs);
+    dev = devs ? rcu_dereference(devs[index]) : NULL;
+    if (dev == NULL || dev->producer == NULL)
+    {
+        rcu_read_unlock();
+        return -ENODEV;
+    }
+
+    p = get_cpu_ptr(dev->producer);
+
+    for (;;)
+    {
+        b = &p->bufs[atomic_read(&p->active) & 1];
+        old = atomic_read(&b->reserved);
+
+        /* drainer switched buffers, the active one has changed too */
+        if (old & MYTEST_PBUF_CLOSED)
+            continue;
+
+        if (old + need > MYTEST_PRODUCER_SIZE)
+        {
+            put_cpu_ptr(dev->producer);
+            atomic64_inc(&dev->producer_dropped);
+            rcu_read_unlock();
+            return -ENOSPC;
+        }
+
+        if (atomic_cmpxchg(&b->reserved, old, old + need) == old)
+            break;
+    }
+
+    *(u32*) (b->data + old) = len;
+    memcpy(b->data + old + sizeof(u32), data, len);
+
+    /* orders the copy before the commit the drainer waits for */
+    smp_mb__before_atomic();
+    atomic_add(need, &b->committed);
+
+    if (old == 0)
+        irq_work_queue(&p->kick);
+
+    put_cpu_ptr(dev->producer);
+    rcu_read_unlock();
+
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mytest_append);
+
+static int alloc_producers(struct mytest_dev* dev)
+{
+    int cpu;
+    int k;
+
+    dev->producer = alloc_percpu(struct mytest_producer);
+    if (dev->producer == NULL)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct mytest_producer* p = per_cpu_ptr(dev->producer, cpu);
+
+        atomic_set(&p->active, 0);
+        init_irq_work(&p->kick, producer_kick);
+        p->dev = dev;
+
+        for (k = 0;  k < 2;  k++)
+        {
+            atomic_set(&p->bufs[k].reserved, 0);
+            atomic_set(&p->bufs[k].committed, 0);
+            p->bufs[k].data = kmalloc_node(MYTEST_PRODUCER_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+            if (p->bufs[k].data == NULL)
+            {
+                free_producers(dev);
+                return -ENOMEM;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* no producers can find the device any more, see remove_device() */
+static void free_producers(struct mytest_dev* dev)
+{
+    int cpu;
+
+    if (dev->producer == NULL)
+        return;
+
+    for_each_possible_cpu(cpu)
+        irq_work_sync(&per_cpu_ptr(dev->producer, cpu)->kick);
+    cancel_work_sync(&dev->producer_work);
+
+    for_each_possible_cpu(cpu)
+    {
+        struct mytest_producer* p = per_cpu_ptr(dev->producer, cpu);
+        kfree(p->bufs[0].data);
+        kfree(p->bufs[1].data);
+    }
+
+    free_percpu(dev->producer);
+    dev->producer = NULL;
+}
+
+static void producer_kick(struct irq_work* work)
+{
+    struct mytest_producer* p = container_of(work, struct mytest_producer, kick);
+
+    schedule_work(&p->dev->producer_work);
+}
+
+static void producer_work_func(struct work_struct* work)
+{
+    struct mytest_dev* dev = container_of(work, struct mytest_dev, producer_work);
+    int cpu;
+    int k;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct mytest_producer* p = per_cpu_ptr(dev->producer, cpu);
+
+        /* the inactive buffer can hold a late record from a producer that missed the switch */
+        k = atomic_read(&p->active) & 1;
+        drain_pbuf(dev, &p->bufs[k ^ 1]);
+
+        if (atomic_read(&p->bufs[k].reserved) == 0)
+            continue;
+
+        atomic_set(&p->active, k ^ 1);
+        smp_mb();
+        drain_pbuf(dev, &p->bufs[k]);
+    }
+}
+
+/* b is not active, except for producers that have not noticed yet */
+static void drain_pbuf(struct mytest_dev* dev, struct mytest_pbuf* b)
+{
+    struct iov_iter iter;
+    struct kvec kv[MYTEST_DRAIN_SEGS];
+    unsigned int maxsegs;
+    unsigned int nseg;
+    unsigned int k;
+    size_t total;
+    ssize_t done;
+    int reserved;
+    int first;
+    int pos;
+
+    do
     {
-        struct sched_param sp;
-        int err;
-        display_prio(t);
-        sp.sched_priority = MAX_RT_PRIO - 1;
-        err = sched_setscheduler(current, SCHED_RR, &sp);
-        if (err)
-            printk(KERN_ALERT "mytest: failed to set thread priority, error: %d\n", err);
-        display_prio(t);
+        reserved = atomic_read(&b->reserved);
     }
+    while (atomic_cmpxchg(&b->reserved, reserved, reserved | MYTEST_PBUF_CLOSED) != reserved);
 
-    for (;;)
+    if (reserved == 0)
     {
-        schedule_timeout_killable(8 * HZ);
-        if (kthread_should_stop())
-        {
-            printk(KERN_ALERT "mytest: thread %d exiting...\n", t->m_index);
-            return 0;
-        }
-        printk(KERN_ALERT "mytest: thread %d\n", t->m_index);
+        atomic_set(&b->reserved, 0);
+        return;
     }
 
-    // do_exit();
-    // return 0;
-}
+    while (atomic_read(&b->committed) != reserved)
+        cpu_relax();
+    smp_rmb();
 
-static void display_prio(struct my_thread_struct* t)
-{
-    switch (current->policy)
+    /* in framed mode each append stores one record */
+    maxsegs = READ_ONCE(dev->framed) ? 1 : MYTEST_DRAIN_SEGS;
+
+    for (pos = 0;  pos < reserved;  )
     {
-    case SCHED_NORMAL:
-        printk(KERN_ALERT "mytest: thread %d (SCHED_NORMAL, nice=%d)\n", t->m_index, task_nice(current));
-        break;
+        first = pos;
+        nseg = 0;
+        total = 0;
 
-    case SCHED_FIFO:
-        printk(KERN_ALERT "mytest: thread %d (SCHED_FIFO, rt_prio=%u)\n", t->m_index, current->rt_priority);
-        break;
+        while (pos < reserved && nseg < maxsegs)
+        {
+            u32 len = *(u32*) (b->data + pos);
 
-    case SCHED_RR:
-        printk(KERN_ALERT "mytest: thread %d (SCHED_RR, rt_prio=%u)\n", t->m_index, current->rt_priority);
-        break;
+            kv[nseg].iov_base = b->data + pos + sizeof(u32);
+            kv[nseg].iov_len = len;
+            nseg++;
+            total += len;
+            pos += ALIGN(sizeof(u32) + len, sizeof(u32));
+        }
 
-    case SCHED_BATCH:
-        printk(KERN_ALERT "mytest: thread %d (SCHED_BATCH, nice=%d)\n", t->m_index, task_nice(current));
-        break;
+        iov_iter_kvec(&iter, WRITE | ITER_KVEC, kv, nseg, total);
 
-    case SCHED_IDLE:
-        printk(KERN_ALERT "mytest: thread %d (SCHED_IDLE, nice=%d)\n", t->m_index, task_nice(current));
-        break;
+        /* records are stored whole or not at all */
+        done = append_iter(dev, &iter, false, true);
+        if (done == total)
+            continue;
 
-    default:
-        printk(KERN_ALERT "mytest: thread %d (SCHED class %u)\n", t->m_index, current->policy);
-        break;
-    }
-}
+        /* the device has no room for the whole batch, go on one record at a time */
+        if (done == 0 && nseg > 1)
+        {
+            maxsegs = 1;
+            pos = first;
+            continue;
+        }
 
-static int my_cdev_open(struct inode* inode, struct file* filp)
-{
-    unsigned int mj = imajor(inode);
-    unsigned int mn = iminor(inode);
-    struct mytest_dev* dev;
-    
-    if (mj != my_cdev_major || mn < my_cdev_minor || mn >= my_cdev_minor + NDEVICES)
-        return -ENODEV;
-    
-    /* store a pointer to struct mytest_dev here for other methods */
-    dev = &mytest_devs[mn - my_cdev_minor];
-    filp->private_data = dev; 
-    
-    if (inode->i_cdev != &dev->cdev)
-        return -ENODEV;
-    
-    /* may want to initialized dev here on first or next opening */
+        /* storing can still stop short if chunks run out, count what did not make it */
+        for (k = 0;  k < nseg;  k++)
+        {
+            if (done >= (ssize_t) kv[k].iov_len)
+                done -= kv[k].iov_len;
+            else
+                break;
+        }
+        atomic64_add(nseg - k, &dev->producer_dropped);
+    }
 
-    return 0;
+    atomic_set(&b->committed, 0);
+    smp_wmb();
+    atomic_set(&b->reserved, 0);
 }
 
-static int my_cdev_release(struct inode* inode, struct file* filp)
-{
-    return 0;
-}
+/*
+ * Framed mode. Each write is stored as a record: struct mytest_record and
+ * the payload, padded to MYTEST_RECORD_ALIGN. buffer_start always sits on a
+ * record boundary, so readers can walk record headers from any position they
+ * got from the device.
+ *
+ * To find records by sequence number or time without walking the whole
+ * window, the writer keeps a sparse index with an entry at least every
+ * MYTEST_INDEX_STRIDE bytes. Entries are in stream order, so both keys
+ * increase along the index and a binary search narrows a seek down to the
+ * few records between two entries. The index only covers the window, which
+ * bounds its size to maxsize / MYTEST_INDEX_STRIDE entries.
+ */
 
-/* loff_t is long long */
-/* size_t is ulong */
-static ssize_t my_cdev_write(struct file* filp, const char __user* buf, size_t count, loff_t* fpos)
+static const char record_pad[MYTEST_RECORD_ALIGN];
+
+static int set_framed(struct mytest_dev* dev, bool framed)
 {
+    struct mytest_index_entry* rindex = NULL;
+    size_t rcap = DIV_ROUND_UP(dev->maxsize, MYTEST_INDEX_STRIDE) + 1;
+    int error = 0;
 
-    struct mytest_dev *dev = (struct mytest_dev*) filp->private_data;
-    char* p;
+    if (framed)
+    {
+        rindex = kvzalloc(rcap * sizeof(struct mytest_index_entry), GFP_KERNEL);
+        if (rindex == NULL)
+            return -ENOMEM;
+    }
 
-    /* As of 3.8.x Linux does not have killable/interruptible rw lock */
-    /* If it had and we got interrupted, should return -EINTR */
-    down_write(& dev->rwsem);
+    mutex_lock(& dev->wlock);
 
-    if (dev->buffer_size >= my_cdev_maxsize)
-        count = 0;
+    if (framed == dev->framed)
+        ;
+    else if (framed && (dev->staging || dev->compress))
+        error = -EINVAL;
+    else if (dev->buffer_size != dev->buffer_start)
+        error = -EBUSY;
     else
-        count = min(count, my_cdev_maxsize - dev->buffer_size);
-
-    if (count == 0)
     {
-        up_write(& dev->rwsem);
-        return 0;
+        swap(dev->rindex, rindex);
+        dev->rcap = framed ? rcap : 0;
+        dev->rfirst = dev->rnext = 0;
+        WRITE_ONCE(dev->framed, framed);
     }
 
-    /* write to our device is append-only, so we ignore the value of *fpos on input */
+    mutex_unlock(& dev->wlock);
+
+    /* the unused new index, or the old one */
+    kvfree(rindex);
+
+    return error;
+}
+
+/*
+ * append_iter() for framed mode, called with wlock held and releases it.
+ * The whole iterator becomes one record, stored whole or not at all.
+ */
+static ssize_t append_record(struct mytest_dev* dev, struct iov_iter* from, bool nowait)
+{
+    size_t count = iov_iter_count(from);
+    size_t total = MYTEST_RECORD_SIZE(count);
+    size_t start = dev->buffer_start;
+    size_t size = dev->buffer_size;
+    struct mytest_index_entry* e;
+    struct mytest_record hdr;
+    struct iov_iter iter;
+    struct kvec kv;
+    size_t done;
+    ssize_t error = 0;
 
-    if (dev->buffer == NULL)
+    if (count == 0 || count > U32_MAX || total > dev->maxsize)
     {
-        p = kmalloc(count, GFP_KERNEL);
+        mutex_unlock(& dev->wlock);
+        return count ? -EMSGSIZE : 0;
     }
-    else
+
+    if (size + total - start > dev->maxsize)
     {
-        p = kmalloc(dev->buffer_size + count, GFP_KERNEL);
-        if (p) memcpy(p, dev->buffer, dev->buffer_size);
+        if (!dev->ring)
+        {
+            mutex_unlock(& dev->wlock);
+            return 0;
+        }
+
+        /* retire whole records, see append_iter() for the ordering */
+        start = skip_records(dev, start, size + total - dev->maxsize);
+        WRITE_ONCE(dev->buffer_start, start);
+        WRITE_ONCE(mmap_header(dev)->data_start, start);
+        smp_wmb();
     }
 
-    if (p == NULL)
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.len = count;
+    hdr.seq = dev->next_seq;
+    /* keep timestamps ordered for find_record(), even if the clock is set back */
+    hdr.time_ns = max_t(u64, ktime_get_real_ns(), dev->last_time);
+
+    kv.iov_base = &hdr;
+    kv.iov_len = sizeof(hdr);
+    iov_iter_kvec(&iter, WRITE | ITER_KVEC, &kv, 1, sizeof(hdr));
+    done = store_iter(dev, size, &iter, sizeof(hdr), nowait, &error);
+
+    if (done == sizeof(hdr))
+        done += store_iter(dev, size + done, from, count, nowait, &error);
+
+    /* chunks are reused in ring mode, so the padding has to be written too */
+    if (done == sizeof(hdr) + count && done < total)
     {
-        up_write(& dev->rwsem);
-        return -ENOMEM;
+        kv.iov_base = (void*) record_pad;
+        kv.iov_len = total - done;
+        iov_iter_kvec(&iter, WRITE | ITER_KVEC, &kv, 1, total - done);
+        done += store_iter(dev, size + done, &iter, total - done, nowait, &error);
     }
 
-    if (copy_from_user(p + dev->buffer_size, buf, count))
+    if (done != total)
     {
-        if (p != dev->buffer)
-            kfree(p);
-        up_write(& dev->rwsem);
-        return -EFAULT;
+        mutex_unlock(& dev->wlock);
+        return error;
     }
 
-    if (p != dev->buffer)
+    prune_index(dev);
+    if (dev->rnext == dev->rfirst ||
+        size >= dev->rindex[(dev->rnext - 1) % dev->rcap].offset + MYTEST_INDEX_STRIDE)
     {
-        if (dev->buffer);
-            kfree(dev->buffer);
-        dev->buffer = p;
+        /* cannot happen while entries are spaced out and pruned, but never overrun the ring */
+        if (dev->rnext - dev->rfirst == dev->rcap)
+            dev->rfirst++;
+
+        e = &dev->rindex[dev->rnext++ % dev->rcap];
+        e->seq = hdr.seq;
+        e->time_ns = hdr.time_ns;
+        e->offset = size;
     }
 
-    dev->buffer_size += count;
-    *fpos += count;
+    dev->next_seq++;
+    dev->last_time = hdr.time_ns;
 
-    wake_up_interruptible(&dev->out_wait_q);
-        
-    up_write(& dev->rwsem);
+    size += total;
+    smp_store_release(& dev->buffer_size, size);
+    smp_wmb();
+    WRITE_ONCE(mmap_header(dev)->data_size, size);
+
+    mutex_unlock(& dev->wlock);
+
+    wake_readers(dev);
 
     return count;
 }
 
-static ssize_t my_cdev_read(struct file* filp, char __user* buf, size_t count, loff_t* fpos)
+/*
+ * The first record boundary at or above want, walking from the record at
+ * offset. Index entries let it jump over most of the way. Caller holds wlock.
+ */
+static size_t skip_records(struct mytest_dev* dev, size_t offset, size_t want)
 {
-    struct mytest_dev *dev = (struct mytest_dev*) filp->private_data;
-    loff_t offset;
+    struct mytest_record hdr;
+    size_t i;
 
-    /* As of 3.8.x Linux does not have killable/interruptible rw lock */
-    /* If it had and we got interrupted, should return -EINTR */
-    down_read(& dev->rwsem);
+    for (i = dev->rfirst;  i != dev->rnext;  i++)
+    {
+        size_t at = dev->rindex[i % dev->rcap].offset;
+        if (at > want)
+            break;
+        offset = max(offset, at);
+    }
 
-    offset = *fpos;
-    if (offset < 0)
+    while (offset < want && offset < dev->buffer_size)
     {
-        up_read(& dev->rwsem);
-        return -EINVAL;
+        copy_chunks_to_buf(dev, (char*) &hdr, offset, sizeof(hdr));
+        offset += MYTEST_RECORD_SIZE((size_t) hdr.len);
     }
-    if (offset >= dev->buffer_size)
+
+    return offset;
+}
+
+/*
+ * Length of the whole records starting at offset that fit into len bytes.
+ * Lockless like the rest of the read side: a header overwritten by a ring
+ * writer meanwhile reads as garbage, and the caller's buffer_start recheck
+ * discards the result then.
+ */
+static size_t whole_records(struct mytest_dev* dev, size_t offset, size_t len)
+{
+    struct mytest_record hdr;
+    size_t done = 0;
+    size_t n;
+
+    while (len - done >= sizeof(hdr))
     {
-        up_read(& dev->rwsem);
-        return 0;
+        copy_chunks_to_buf(dev, (char*) &hdr, offset + done, sizeof(hdr));
+        n = MYTEST_RECORD_SIZE((size_t) hdr.len);
+        if (n > len - done)
+            break;
+        done += n;
     }
 
-    count = min(count, dev->buffer_size - (size_t) offset);
-    if (count == 0)
+    return done;
+}
+
+/* drop index entries for records that left the window, caller holds wlock */
+static void prune_index(struct mytest_dev* dev)
+{
+    while (dev->rfirst != dev->rnext && dev->rindex[dev->rfirst % dev->rcap].offset < dev->buffer_start)
+        dev->rfirst++;
+}
+
+/*
+ * Offset of the first record with sequence number (MYTEST_SEEK_SEQ) or
+ * timestamp (MYTEST_SEEK_TIME) at or above value, or the end of data.
+ * *seq gets the record's sequence number. Caller holds wlock.
+ */
+static size_t find_record(struct mytest_dev* dev, u32 whence, u64 value, u64* seq)
+{
+    struct mytest_record hdr;
+    size_t offset = dev->buffer_start;
+    size_t lo;
+    size_t hi;
+
+    prune_index(dev);
+
+    /* find the first entry at or above value, all records before the entry preceding it are below */
+    lo = dev->rfirst;
+    hi = dev->rnext;
+    while (lo < hi)
     {
-        up_read(& dev->rwsem);
-        return 0;
+        size_t mid = lo + (hi - lo) / 2;
+        struct mytest_index_entry* e = &dev->rindex[mid % dev->rcap];
+
+        if ((whence == MYTEST_SEEK_SEQ ? e->seq : e->time_ns) < value)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    if (lo != dev->rfirst)
+        offset = dev->rindex[(lo - 1) % dev->rcap].offset;
 
-    if (copy_to_user(buf, dev->buffer + offset, count))
+    while (offset < dev->buffer_size)
     {
-        up_read(& dev->rwsem);
+        copy_chunks_to_buf(dev, (char*) &hdr, offset, sizeof(hdr));
+        if ((whence == MYTEST_SEEK_SEQ ? hdr.seq : hdr.time_ns) >= value)
+        {
+            *seq = hdr.seq;
+            return offset;
+        }
+        offset += MYTEST_RECORD_SIZE((size_t) hdr.len);
+    }
+
+    *seq = dev->next_seq;
+    return offset;
+}
+
+static long do_seek_record(struct file* filp, struct mytest_seek __user* useek)
+{
+    struct mytest_file* mf = (struct mytest_file*) filp->private_data;
+    struct mytest_dev* dev = mf->dev;
+    struct mytest_consumer_group* g;
+    struct mytest_seek req;
+    size_t offset;
+    u64 seq;
+
+    if (copy_from_user(&req, useek, sizeof(req)))
         return -EFAULT;
+    if ((req.whence != MYTEST_SEEK_SEQ && req.whence != MYTEST_SEEK_TIME) || req.reserved)
+        return -EINVAL;
+
+    /* a group member moves the group cursor, as in my_cdev_llseek() */
+    g = lock_group(mf, false);
+    if (IS_ERR(g))
+        return PTR_ERR(g);
+
+    mutex_lock(& dev->wlock);
+    if (!dev->framed)
+    {
+        mutex_unlock(& dev->wlock);
+        if (g)
+            mutex_unlock(&g->lock);
+        return -EINVAL;
     }
-    
-    *fpos += count;
+    offset = find_record(dev, req.whence, req.value, &seq);
+    mutex_unlock(& dev->wlock);
 
-    up_read(& dev->rwsem);
+    if (g)
+    {
+        WRITE_ONCE(g->cursor, offset);
+        mutex_unlock(&g->lock);
+        schedule_work(&dev->trim_work);
+    }
 
-    return count;
+    filp->f_pos = offset;
+
+    req.offset = offset;
+    req.seq = seq;
+    if (copy_to_user(useek, &req, sizeof(req)))
+        return -EFAULT;
+
+    return 0;
 }
 
-static loff_t my_cdev_llseek(struct file* filp, loff_t offset, int whence)
+/*
+ * Memory shrinker. Under memory pressure the VM asks how many chunks the
+ * devices could give up and then has some of them freed, oldest first.
+ * Each device has a policy: keep everything (off), give up only data that
+ * every reader and every consumer group has read already (unread), or give
+ * up the oldest data whether read or not (oldest). Readers that lose data
+ * this way see it as lost, just as with ring mode overwrites. Mappings of
+ * the device are not readers here, chunks they map stay valid for them but
+ * drop out of the window.
+ *
+ * Reclaim can run while this very task holds wlock (a writer allocating a
+ * chunk) or is inside a chunk_srcu read section (a reader faulting on the
+ * user buffer), so the shrinker only ever trylocks, and leaves the SRCU
+ * grace period and the actual freeing to evict_work. It walks the device
+ * table under RCU, which keeps the devices it finds from going away.
+ */
+
+static int parse_shrink(const char* buf)
 {
-    struct mytest_dev *dev = (struct mytest_dev*) filp->private_data;
-    loff_t newpos = 0;
-    
-    /* As of 3.8.x Linux does not have killable/interruptible rw lock */
-    /* If it had and we got interrupted, should return -EINTR */
-    down_read(& dev->rwsem);
+    int k;
 
-    switch(whence)
+    for (k = 0;  k < MYTEST_NSHRINK;  k++)
     {
-    case SEEK_SET:
-        newpos = offset;
-        break;
+        if (sysfs_streq(buf, shrink_names[k]))
+            return k;
+    }
 
-    case SEEK_CUR:
-        newpos = filp->f_pos + offset;
-        break;
+    return -EINVAL;
+}
 
-    case SEEK_END:
-        newpos = dev->buffer_size + offset;
-        break;
+static unsigned long shrink_count(struct shrinker* s, struct shrink_control* sc)
+{
+    struct mytest_dev** devs;
+    unsigned long count = 0;
+    unsigned int k;
 
-    default:
-        up_read(& dev->rwsem);
-        return -EINVAL;
+    rcu_read_lock();
+
+    devs = rcu_dereference(mytest_devs);
+    for (k = 0;  devs && k < par_max_devices;  k++)
+    {
+        struct mytest_dev* dev = rcu_dereference(devs[k]);
+        size_t start;
+        size_t limit;
+
+        if (dev == NULL || READ_ONCE(dev->shrink) == MYTEST_SHRINK_OFF)
+            continue;
+        if (!mutex_trylock(&dev->groups_lock))
+            continue;
+
+        start = READ_ONCE(dev->buffer_start);
+        limit = shrink_limit(dev);
+        if (limit > start)
+            count += (limit >> PAGE_SHIFT) - (start >> PAGE_SHIFT);
+
+        mutex_unlock(&dev->groups_lock);
     }
 
-    if (newpos < 0 || newpos > dev->buffer_size) 
-        return -EINVAL;
-    
-    up_read(& dev->rwsem);
+    rcu_read_unlock();
 
-    filp->f_pos = newpos;
-    return newpos;
+    return count;
 }
 
-static unsigned int my_cdev_poll(struct file* filp, struct poll_table_struct* wait)
+static unsigned long shrink_scan(struct shrinker* s, struct shrink_control* sc)
 {
-    struct mytest_dev *dev = (struct mytest_dev*) filp->private_data;
-    unsigned int mask = 0;
+    struct mytest_dev** devs;
+    unsigned long freed = 0;
+    unsigned int k;
 
-    down_read(& dev->rwsem);
+    rcu_read_lock();
 
-    poll_wait(filp, &dev->out_wait_q, wait);
+    devs = rcu_dereference(mytest_devs);
+    for (k = 0;  devs && k < par_max_devices && freed < sc->nr_to_scan;  k++)
+    {
+        struct mytest_dev* dev = rcu_dereference(devs[k]);
 
-    if (filp->f_pos < dev->buffer_size)
-        mask |= POLLIN | POLLRDNORM;
+        if (dev && READ_ONCE(dev->shrink) != MYTEST_SHRINK_OFF)
+            freed += shrink_device(dev, sc->nr_to_scan - freed);
+    }
 
-    if (dev->buffer_size < my_cdev_maxsize)
-        mask |= POLLOUT | POLLWRNORM;
+    rcu_read_unlock();
 
-    up_read(& dev->rwsem);
+    return freed ? freed : SHRINK_STOP;
+}
 
-    return mask;
+/*
+ * Stream offset below which the device's policy lets data go.
+ * Caller holds groups_lock.
+ */
+static size_t shrink_limit(struct mytest_dev* dev)
+{
+    struct mytest_consumer_group* g;
+    struct mytest_file* mf;
+    size_t start = READ_ONCE(dev->buffer_start);
+    size_t limit = smp_load_acquire(& dev->buffer_size);
+
+    if (READ_ONCE(dev->shrink) == MYTEST_SHRINK_OLDEST)
+        return limit;
+
+    /* readers already behind the window hold nothing */
+    list_for_each_entry(g, &dev->groups, link)
+        limit = min(limit, max(READ_ONCE(g->cursor), start));
+
+    spin_lock(&dev->files_lock);
+    list_for_each_entry(mf, &dev->files, link)
+        limit = min(limit, max(file_pos(mf), start));
+    spin_unlock(&dev->files_lock);
+
+    return limit;
 }
 
 /*
- * New ioctl interface as of 2.6.11.
- * BKL is not taken prior to the call.
- * inode is available as filp->f_dentry->d_inode.
+ * Move the window start up over at most nr chunks the policy allows to drop,
+ * and hand those chunks to evict_work. Returns the number of chunks.
  */
-static long my_cdev_unlocked_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
+static unsigned long shrink_device(struct mytest_dev* dev, unsigned long nr)
 {
-    // struct mytest_dev *dev = (struct mytest_dev*) filp->private_data;
-    long error;
+    unsigned long freed = 0;
+    size_t start;
+    size_t target;
+    size_t k;
 
-    if (cmd == IOC_MYTEST_PRINT)
-    {
-        char buf[135];
-        error = strncpy_from_user(buf, (const char __user*) arg, sizeof(buf));
-        if (error < 0)  return error;
-        buf[sizeof(buf) - 1] = 0;
-        printk(KERN_ALERT "mytest user print: [%s]\n", buf);
+    if (!mutex_trylock(&dev->groups_lock))
         return 0;
-    }
-    else if (cmd == IOC_MYTEST_PANIC)
+    if (!mutex_trylock(& dev->wlock))
     {
-        char buf[135];
-        if (!capable(CAP_SYS_ADMIN))
-            return -EPERM;
-        error = strncpy_from_user(buf, (const char __user*) arg, sizeof(buf));
-        if (error < 0)  return error;
-        buf[sizeof(buf) - 1] = 0;
-        call_fs_sync(); call_fs_sync(); call_fs_sync();
-        panic("mytest user panic: [%s]", buf);
+        mutex_unlock(&dev->groups_lock);
         return 0;
     }
-    else if (cmd == IOC_MYTEST_OOPS)
+
+    start = dev->buffer_start;
+    target = min_t(size_t, shrink_limit(dev), ((start >> PAGE_SHIFT) + nr) << PAGE_SHIFT) & PAGE_MASK;
+
+    if (target > start)
     {
-        static volatile int res;
-        static volatile int zero = 0;
+        /* whole records only, readers' positions are record boundaries so this stays below them */
+        if (dev->framed)
+            target = skip_records(dev, start, target);
 
-        if (!capable(CAP_SYS_ADMIN))
-            return -EPERM;
+        WRITE_ONCE(dev->buffer_start, target);
+        WRITE_ONCE(mmap_header(dev)->data_start, target);
+        smp_wmb();
+        atomic64_add(target - start, &dev->evicted);
 
-        printk(KERN_ALERT "mytest: about do to oops ...\n");
-        call_fs_sync(); call_fs_sync(); call_fs_sync();
-        res = 100 / zero;
-        printk(KERN_ALERT "mytest: completed oops.\n");
-        return 0;
+        for (k = start >> PAGE_SHIFT;  k < (target >> PAGE_SHIFT);  k++)
+        {
+            struct page** slot = chunk_slot(dev, k << PAGE_SHIFT);
+
+            if (*slot)
+            {
+                list_add(&(*slot)->lru, &dev->evict_list);
+                WRITE_ONCE(*slot, NULL);
+                freed++;
+            }
+        }
     }
-    else
+
+    mutex_unlock(& dev->wlock);
+    mutex_unlock(&dev->groups_lock);
+
+    if (freed)
     {
-        return -EINVAL;
+        atomic64_add(freed, &chunk_stats.shrunk);
+        schedule_work(&dev->evict_work);
     }
-}
 
-/*
- * Used by 32-bit processes on 64-bit systems.
- * Should provide conversion of arguments if required.
- * BKL is not taken prior to the call.
- * inode is available as filp->f_dentry->d_inode.
- */
-static long my_cdev_compat_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
-{
-    return my_cdev_unlocked_ioctl(filp, cmd, arg);
+    return freed;
 }
 
-static void call_fs_sync(void)
+/* also called on device release, to free what is left */
+static void evict_work_func(struct work_struct* work)
 {
-    // sys_sync, emergency_sync and syscall table are not exported from kernel
+    struct mytest_dev* dev = container_of(work, struct mytest_dev, evict_work);
+    struct page* page;
+    struct page* tmp;
+    LIST_HEAD(freelist);
 
-    // emergency_sync();
-    // set_current_state(TASK_UNINTERRUPTIBLE);
-    // schedule_timeout(HZ / 10);
+    mutex_lock(& dev->wlock);
+    list_splice_init(&dev->evict_list, &freelist);
+    mutex_unlock(& dev->wlock);
+
+    if (list_empty(&freelist))
+        return;
+
+    /* readers that picked up these chunks before they were unpublished */
+    synchronize_srcu(&chunk_srcu);
+
+    list_for_each_entry_safe(page, tmp, &freelist, lru)
+    {
+        list_del(&page->lru);
+        free_chunk(page);
+    }
+
+    /* room for writers */
+    wake_up_interruptible(&dev->out_wait_q);
 }
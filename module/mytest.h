@@ -1,3 +1,282 @@
+#ifndef _MYTEST_H
+#define _MYTEST_H
+
+#include <linux/types.h>
+
 #define IOC_MYTEST_PRINT   _IO('m', 1)
 #define IOC_MYTEST_PANIC   _IO('m', 2)
 #define IOC_MYTEST_OOPS    _IO('m', 3)
+
+/*
+ * Switch device to ring mode (arg points to int 1) or back to linear mode (0).
+ * In ring mode the device keeps the newest data and overwrites the oldest,
+ * in linear mode writes return 0 once the device is full.
+ */
+#define IOC_MYTEST_SET_RING  _IOW('m', 4, int)
+
+/*
+ * Fetch and reset the number of bytes this open file skipped because they were
+ * overwritten (ring mode) before it read them. arg points to __u64.
+ */
+#define IOC_MYTEST_GET_LOST  _IOR('m', 5, __u64)
+
+/*
+ * Submit several commands in one call. arg points to struct mytest_batch,
+ * which points to an array of entries. Each entry is processed in order and
+ * gets its own result in status (0 or -errno), the call itself only fails
+ * if the batch cannot be read or written back.
+ *
+ * Allowed commands: IOC_MYTEST_PRINT (payload is the text, len its length,
+ * no terminating NUL needed), IOC_MYTEST_SET_RING and IOC_MYTEST_GET_LOST
+ * (payload is the pointer those take as arg, len is ignored).
+ *
+ * Pointers are carried in __u64 fields, so 32-bit and 64-bit callers use
+ * the same layout.
+ */
+struct mytest_batch_entry
+{
+    __u32  cmd;
+    __u32  len;
+    __u64  payload;         /* user pointer */
+    __s32  status;          /* out */
+    __u32  reserved;        /* must be 0 */
+};
+
+struct mytest_batch
+{
+    __u64  entries;         /* user pointer to struct mytest_batch_entry[count] */
+    __u32  count;
+    __u32  flags;           /* must be 0 */
+};
+
+#define MYTEST_BATCH_MAX    4096
+
+#define IOC_MYTEST_BATCH     _IOW('m', 6, struct mytest_batch)
+
+/*
+ * Enable (arg points to int 1) or disable (0) per-CPU write staging.
+ * Writes then go to a staging buffer of the writer's CPU and are folded into
+ * the device in batches, which lets writers on different CPUs proceed without
+ * contending on the device. The bytes of one write() are kept together, and
+ * writes from the same CPU keep their order, but writes from different CPUs
+ * appear in the order their CPUs' batches are folded in.
+ */
+#define IOC_MYTEST_SET_STAGING  _IOW('m', 7, int)
+
+/*
+ * Search the device data for a byte pattern, in the kernel, without copying
+ * the data out. arg points to struct mytest_search.
+ *
+ * Matches are reported in increasing order, as the stream offset of each match
+ * (overlapping matches included), or with MYTEST_SEARCH_LINES as the offset
+ * of each '\n'-terminated line containing a match, once per line. The start of
+ * the searched range counts as the start of a line.
+ *
+ * A single call looks at a bounded range and reports at most max_matches
+ * results. On return, resume is the offset to pass as start to continue the
+ * search, it equals end once the whole range has been searched.
+ */
+struct mytest_search
+{
+    __u64  pattern;         /* user pointer to the pattern bytes */
+    __u32  pattern_len;     /* 1 .. MYTEST_SEARCH_PATTERN_MAX */
+    __u32  flags;           /* MYTEST_SEARCH_xxx */
+    __u64  start;           /* in: offset to search from, out: actual start (oldest data may be gone) */
+    __u64  end;             /* in: 0 or offset to search up to, out: actual end */
+    __u64  matches;         /* user pointer to __u64[max_matches] */
+    __u32  max_matches;
+    __u32  nmatches;        /* out */
+    __u64  resume;          /* out */
+};
+
+#define MYTEST_SEARCH_LINES         (1 << 0)
+#define MYTEST_SEARCH_PATTERN_MAX   256
+
+#define IOC_MYTEST_SEARCH  _IOWR('m', 8, struct mytest_search)
+
+/*
+ * Measure inter-processor call costs, arg points to struct mytest_ipi_bench.
+ * Needs CAP_SYS_ADMIN, since stop_machine() stalls the whole system.
+ *
+ * All times are medians over the given number of iterations, in ns.
+ * matrix[i * ncpus + j] is the round trip of a synchronous cross call from CPU i
+ * to CPU j (0 on the diagonal and for offline CPUs). broadcast[n] is the time
+ * to run a synchronous cross call on n other CPUs at once. Either pointer can
+ * be 0 to skip that part.
+ */
+struct mytest_ipi_bench
+{
+    __u32  ncpus;                   /* in: dimension of the arrays, out: number of possible CPUs */
+    __u32  iterations;              /* 0 for the default */
+    __u64  matrix;                  /* user pointer to __u64[ncpus * ncpus] */
+    __u64  broadcast;               /* user pointer to __u64[ncpus] */
+    __u64  stop_machine_ns;         /* out: how long stop_machine() held all CPUs */
+    __u64  stop_machine_max_ns;     /* out */
+};
+
+#define IOC_MYTEST_IPI_BENCH  _IOWR('m', 9, struct mytest_ipi_bench)
+
+/*
+ * Wakeup thresholds of this open file, arg points to struct mytest_wakeup.
+ * poll() reports POLLIN, and a waiting poller is woken, only once at least
+ * min_bytes are pending past the file position, or once some data has been
+ * pending for max_delay_us (0 means no deadline, so a tail shorter than
+ * min_bytes stays unnoticed until more data arrives). min_bytes 0 or 1 is
+ * the default of waking on any data.
+ *
+ * Files flagged MYTEST_WAKEUP_EXCLUSIVE form a worker pool on the device:
+ * a write wakes only one of the ready pool members, taking turns, instead
+ * of all of them. Pollers sharing one file can get the same from epoll
+ * with EPOLLEXCLUSIVE.
+ */
+struct mytest_wakeup
+{
+    __u32  min_bytes;
+    __u32  max_delay_us;
+    __u32  flags;           /* MYTEST_WAKEUP_xxx */
+    __u32  reserved;        /* must be 0 */
+};
+
+#define MYTEST_WAKEUP_EXCLUSIVE     (1 << 0)
+
+#define IOC_MYTEST_SET_WAKEUP  _IOW('m', 10, struct mytest_wakeup)
+
+/*
+ * Keep a compressed archive of data leaving the window, arg points to int
+ * (0 or 1). Data about to leave the window is compressed in the background,
+ * and reads below the window start (see mmap header data_start) are served
+ * from the archive. Outside of ring mode archived data leaves the window when room is
+ * needed, so data_start can move up just as in ring mode, and writes stop only
+ * once the archive budget is used up as well. In ring mode the oldest archived
+ * data is dropped to stay within the budget. mmap() and IOC_MYTEST_SEARCH see
+ * the uncompressed window only. Switching the archive off discards it.
+ */
+#define IOC_MYTEST_SET_COMPRESS  _IOW('m', 11, int)
+
+/*
+ * Consumer groups. A group is a named cursor kept by the device, so it
+ * survives closing and reopening: a restarted consumer joins its group again
+ * and continues where the group left off. Files in the same group share the
+ * cursor, each read takes the next bytes after it (a read's ki_pos/pread
+ * offset is ignored), and lseek() moves it.
+ *
+ * While any groups exist, data that every group has read past is dropped and
+ * its memory freed, so outside of ring mode the device holds no more than the
+ * slowest group has yet to read. Readers outside of groups do not hold data.
+ * A group keeps holding data while nobody is attached to it, until deleted.
+ *
+ * IOC_MYTEST_JOIN_GROUP attaches the file to a group (a file can be in one
+ * group at a time) and returns the group's cursor. A new group starts at the
+ * oldest retained byte, or with MYTEST_GROUP_AT_END at the end of data.
+ * IOC_MYTEST_DELETE_GROUP fails with EBUSY while files are attached.
+ */
+#define MYTEST_GROUP_NAME_MAX       32
+#define MYTEST_GROUP_MAX            64      /* groups per device */
+
+struct mytest_group
+{
+    char   name[MYTEST_GROUP_NAME_MAX];   /* NUL-terminated, not empty */
+    __u32  flags;                           /* MYTEST_GROUP_xxx */
+    __u32  reserved;                        /* must be 0 */
+    __u64  cursor;                          /* out: stream offset the group reads next */
+};
+
+#define MYTEST_GROUP_CREATE         (1 << 0)    /* create the group if it does not exist */
+#define MYTEST_GROUP_AT_END         (1 << 1)    /* a new group starts at the end of data */
+
+#define IOC_MYTEST_JOIN_GROUP    _IOWR('m', 12, struct mytest_group)
+#define IOC_MYTEST_LEAVE_GROUP   _IO('m', 13)
+#define IOC_MYTEST_DELETE_GROUP  _IOW('m', 14, struct mytest_group)
+
+/*
+ * Framed mode, arg points to int (0 or 1). Each write() (and each
+ * mytest_append() record) is stored as one record: struct mytest_record
+ * followed by the payload, padded to MYTEST_RECORD_ALIGN. The device assigns
+ * sequence numbers and timestamps. read() returns whole records only, as many
+ * as fit into the buffer, and fails with EMSGSIZE if the next record does not
+ * fit at all. In ring mode whole records are dropped. A write that does not
+ * fit into maxsize fails with EMSGSIZE.
+ *
+ * The mode can only be switched while the device holds no data, and does not
+ * go together with staging or the compressed archive (EINVAL). File positions
+ * must stay on record boundaries: those returned by read(), IOC_MYTEST_SEEK,
+ * or SEEK_SET/SEEK_END to the ends of data.
+ */
+#define IOC_MYTEST_SET_FRAMED  _IOW('m', 15, int)
+
+struct mytest_record
+{
+    __u32  len;             /* payload bytes */
+    __u32  reserved;
+    __u64  seq;             /* 0 for the first record of the device, then consecutive */
+    __u64  time_ns;         /* CLOCK_REALTIME when written, never decreasing */
+};
+
+#define MYTEST_RECORD_ALIGN         8
+#define MYTEST_RECORD_SIZE(len)     ((sizeof(struct mytest_record) + (len) + MYTEST_RECORD_ALIGN - 1) & ~(__u64) (MYTEST_RECORD_ALIGN - 1))
+
+/*
+ * Framed mode: move the file position (or the group cursor) to the first
+ * retained record with sequence number or timestamp at or above value, or to
+ * the end of data if there is none. Positions below the retained data land on
+ * the oldest record. lseek() cannot take whence values of its own, the VFS
+ * rejects anything beyond SEEK_HOLE before the driver sees it.
+ */
+struct mytest_seek
+{
+    __u32  whence;          /* MYTEST_SEEK_xxx */
+    __u32  reserved;        /* must be 0 */
+    __u64  value;
+    __u64  offset;          /* out: new file position */
+    __u64  seq;             /* out: sequence number of the record there (next to be written at the end) */
+};
+
+#define MYTEST_SEEK_SEQ             1
+#define MYTEST_SEEK_TIME            2       /* value is CLOCK_REALTIME in ns */
+
+#define IOC_MYTEST_SEEK  _IOWR('m', 16, struct mytest_seek)
+
+/*
+ * A blocking read at the end of data waits for new data (as much as the
+ * IOC_MYTEST_SET_WAKEUP thresholds ask for), and returns 0 only once the
+ * device is destroyed. A non-blocking read there fails with EAGAIN.
+ * This sets how long a blocking read of this file waits before it fails
+ * with ETIMEDOUT, arg points to __u32 milliseconds (0: no limit, the default).
+ */
+#define IOC_MYTEST_SET_READ_TIMEOUT  _IOW('m', 17, __u32)
+
+/*
+ * mmap() of the device is read-only. The first page of the mapping holds
+ * struct mytest_mmap_header, data chunks follow starting with the second page.
+ * Data byte at stream offset N is in chunk (N / page_size) % data_pages,
+ * i.e. at mapping offset page_size * (1 + (N / page_size) % data_pages) + N % page_size.
+ * As long as the device has not wrapped around (data_start == 0), this is
+ * simply page_size + N.
+ *
+ * The device holds stream offsets [data_start, data_size). data_size is
+ * updated by the kernel after each write, read it with acquire semantics
+ * (e.g. __atomic_load_n(..., __ATOMIC_ACQUIRE)) before touching the data.
+ * In ring mode data_start moves up before old data is overwritten, so re-read
+ * data_start after copying to find out whether the copy is still valid.
+ * Touching chunks that have not been allocated yet raises SIGBUS.
+ */
+struct mytest_mmap_header
+{
+    __u64  data_size;       /* stream offset past the newest byte */
+    __u64  data_capacity;   /* maximum number of bytes the device can hold */
+    __u64  data_start;      /* stream offset of the oldest retained byte */
+    __u64  data_pages;      /* number of data chunks in the mapping */
+};
+
+#ifdef __KERNEL__
+/*
+ * Append a record to device mytest<index> from kernel code. Never sleeps and
+ * takes no locks, so it can be called from any context including hard IRQ
+ * and NMI. Returns 0, -ENODEV, -EMSGSIZE if the record is too large, or
+ * -ENOSPC if the calling CPU's buffer is full (the record is dropped).
+ * In framed mode each call stores one record.
+ */
+int mytest_append(unsigned int index, const void* data, size_t len);
+#endif
+
+#endif // _MYTEST_H
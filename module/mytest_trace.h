@@ -0,0 +1,185 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mytest
+
+#if !defined(_MYTEST_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MYTEST_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the mytest module, under events/mytest/ in tracefs.
+ * Devices are identified by their index, as in /dev/mytestN.
+ */
+
+TRACE_EVENT(mytest_write_enter,
+
+    TP_PROTO(unsigned int dev, size_t count),
+
+    TP_ARGS(dev, count),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(size_t, count)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->count = count;
+    ),
+
+    TP_printk("dev=%u count=%zu", __entry->dev, __entry->count)
+);
+
+TRACE_EVENT(mytest_write_exit,
+
+    TP_PROTO(unsigned int dev, ssize_t ret, size_t buffer_size),
+
+    TP_ARGS(dev, ret, buffer_size),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(ssize_t, ret)
+        __field(size_t, buffer_size)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->ret = ret;
+        __entry->buffer_size = buffer_size;
+    ),
+
+    TP_printk("dev=%u ret=%zd buffer_size=%zu", __entry->dev, __entry->ret, __entry->buffer_size)
+);
+
+TRACE_EVENT(mytest_read,
+
+    TP_PROTO(unsigned int dev, loff_t offset, size_t count, ssize_t ret),
+
+    TP_ARGS(dev, offset, count, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(loff_t, offset)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->offset = offset;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev=%u offset=%lld count=%zu ret=%zd",
+              __entry->dev, (long long) __entry->offset, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(mytest_poll,
+
+    TP_PROTO(unsigned int dev, loff_t pos, size_t buffer_size, unsigned int mask),
+
+    TP_ARGS(dev, pos, buffer_size, mask),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(loff_t, pos)
+        __field(size_t, buffer_size)
+        __field(unsigned int, mask)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->pos = pos;
+        __entry->buffer_size = buffer_size;
+        __entry->mask = mask;
+    ),
+
+    TP_printk("dev=%u pos=%lld buffer_size=%zu mask=%#x",
+              __entry->dev, (long long) __entry->pos, __entry->buffer_size, __entry->mask)
+);
+
+TRACE_EVENT(mytest_wakeup,
+
+    TP_PROTO(unsigned int dev, size_t buffer_size),
+
+    TP_ARGS(dev, buffer_size),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(size_t, buffer_size)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->buffer_size = buffer_size;
+    ),
+
+    TP_printk("dev=%u buffer_size=%zu", __entry->dev, __entry->buffer_size)
+);
+
+TRACE_EVENT(mytest_ioctl,
+
+    TP_PROTO(unsigned int dev, unsigned int cmd, long ret),
+
+    TP_ARGS(dev, cmd, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev=%u cmd=%#x ret=%ld", __entry->dev, __entry->cmd, __entry->ret)
+);
+
+TRACE_EVENT(mytest_timer,
+
+    TP_PROTO(unsigned int index, unsigned int preempt_count),
+
+    TP_ARGS(index, preempt_count),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(unsigned int, preempt_count)
+    ),
+
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->preempt_count = preempt_count;
+    ),
+
+    TP_printk("timer=%u preempt_count=%#x", __entry->index, __entry->preempt_count)
+);
+
+TRACE_EVENT(mytest_thread_tick,
+
+    TP_PROTO(unsigned int index),
+
+    TP_ARGS(index),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+    ),
+
+    TP_fast_assign(
+        __entry->index = index;
+    ),
+
+    TP_printk("thread=%u", __entry->index)
+);
+
+#endif /* _MYTEST_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mytest_trace
+#include <trace/define_trace.h>
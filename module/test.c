@@ -1,17 +1,37 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
 #include <asm-generic/ioctl.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #include "mytest.h"
 
 static int open_device(int flags);
+static int dump_mmap(int fd);
+static int print_batch(const char* text, int count);
+static int search(const char* pattern, int lines);
+static int bench(int argc, char** argv);
+static int ipi_bench(int iterations);
+static int group_read(const char* name);
+static int group_delete(const char* name);
+static int follow(unsigned int min_bytes, unsigned int max_delay_us, int exclusive);
+static int print_records(const char* whence, const char* value);
+static int check(void);
+static int tail(unsigned int timeout_ms);
 
 int
 main(int argc, char **argv)
@@ -51,11 +71,116 @@ main(int argc, char **argv)
             perror("ioctl");
         }
     }
+    else if (0 == strcmp(verb, "mmap") && argc == 2)
+    {
+        fd = open_device(O_RDONLY);
+        error = dump_mmap(fd);
+    }
+    else if (0 == strcmp(verb, "batch") && argc == 4)
+    {
+        error = print_batch(argv[2], atoi(argv[3]));
+    }
+    else if (0 == strcmp(verb, "ring") && argc == 3)
+    {
+        int ring = atoi(argv[2]);
+        fd = open_device(O_WRONLY);
+        if (ioctl(fd, IOC_MYTEST_SET_RING, &ring))
+        {
+            error = errno;
+            perror("ioctl");
+        }
+    }
+    else if (0 == strcmp(verb, "search") && (argc == 3 || argc == 4))
+    {
+        error = search(argv[2], argc == 4 && 0 == strcmp(argv[3], "lines"));
+    }
+    else if (0 == strcmp(verb, "bench") && argc >= 3)
+    {
+        error = bench(argc - 2, argv + 2);
+    }
+    else if (0 == strcmp(verb, "ipi") && (argc == 2 || argc == 3))
+    {
+        error = ipi_bench(argc == 3 ? atoi(argv[2]) : 0);
+    }
+    else if (0 == strcmp(verb, "staging") && argc == 3)
+    {
+        int staging = atoi(argv[2]);
+        fd = open_device(O_WRONLY);
+        if (ioctl(fd, IOC_MYTEST_SET_STAGING, &staging))
+        {
+            error = errno;
+            perror("ioctl");
+        }
+    }
+    else if (0 == strcmp(verb, "compress") && argc == 3)
+    {
+        int compress = atoi(argv[2]);
+        fd = open_device(O_WRONLY);
+        if (ioctl(fd, IOC_MYTEST_SET_COMPRESS, &compress))
+        {
+            error = errno;
+            perror("ioctl");
+        }
+    }
+    else if (0 == strcmp(verb, "group") && argc == 3)
+    {
+        error = group_read(argv[2]);
+    }
+    else if (0 == strcmp(verb, "group-delete") && argc == 3)
+    {
+        error = group_delete(argv[2]);
+    }
+    else if (0 == strcmp(verb, "follow") && (argc == 4 || argc == 5))
+    {
+        error = follow(strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0),
+                       argc == 5 && 0 == strcmp(argv[4], "exclusive"));
+    }
+    else if (0 == strcmp(verb, "tail") && (argc == 2 || argc == 3))
+    {
+        error = tail(argc == 3 ? strtoul(argv[2], NULL, 0) : 0);
+    }
+    else if (0 == strcmp(verb, "check") && argc == 2)
+    {
+        error = check();
+    }
+    else if (0 == strcmp(verb, "framed") && argc == 3)
+    {
+        int framed = atoi(argv[2]);
+        fd = open_device(O_WRONLY);
+        if (ioctl(fd, IOC_MYTEST_SET_FRAMED, &framed))
+        {
+            error = errno;
+            perror("ioctl");
+        }
+    }
+    else if (0 == strcmp(verb, "records") && (argc == 2 || argc == 4))
+    {
+        error = print_records(argc == 4 ? argv[2] : NULL, argc == 4 ? argv[3] : NULL);
+    }
     else
     {
         printf("usage: test print string\n");
         printf("       test panic string\n");
         printf("       test oops\n");
+        printf("       test mmap\n");
+        printf("       test ring 0|1\n");
+        printf("       test staging 0|1\n");
+        printf("       test compress 0|1\n");
+        printf("       test framed 0|1\n");
+        printf("       test records [seq|time value]\n");
+        printf("       test batch string count\n");
+        printf("       test search pattern [lines]\n");
+        printf("       test bench rw writers readers record_size seconds\n");
+        printf("       test bench poll iterations\n");
+        printf("       test bench ioctl iterations\n");
+        printf("       test bench path iterations\n");
+        printf("       test check\n");
+        printf("       test ipi [iterations]\n");
+        printf("       test group name\n");
+        printf("       test group-delete name\n");
+        printf("       test follow min_bytes max_delay_us [exclusive]\n");
+        printf("       test tail [timeout_ms]\n");
+        printf("\nset MYTEST_DEVICE to use a device other than /dev/mytest0\n");
         error = EINVAL;
     }
 
@@ -66,11 +191,1277 @@ static int
 open_device(int flags)
 {
     int error;
-    int fd = open("/dev/mytest", flags);
-    if (fd < 0 && errno == ENOENT)
+    const char* path = getenv("MYTEST_DEVICE");
+    int fd = open(path ? path : "/dev/mytest", flags);
+    if (fd < 0 && errno == ENOENT && !path)
         fd = open("/dev/mytest0", flags);
     if (fd >= 0)  return fd;
     error = errno;
     perror("unable to open device");
     exit(error);
 }
+
+/*
+ * Write device data to stdout, reading it through a mapping instead of read()
+ */
+static int
+dump_mmap(int fd)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    struct mytest_mmap_header* hdr;
+    size_t maplen;
+    __u64 start;
+    __u64 size;
+    __u64 off;
+    char* p;
+
+    hdr = mmap(NULL, pagesize, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+    {
+        perror("mmap");
+        return errno;
+    }
+    maplen = pagesize * (1 + hdr->data_pages);
+    munmap(hdr, pagesize);
+
+    p = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap");
+        return errno;
+    }
+    hdr = (struct mytest_mmap_header*) p;
+
+    size = __atomic_load_n(&hdr->data_size, __ATOMIC_ACQUIRE);
+    start = __atomic_load_n(&hdr->data_start, __ATOMIC_RELAXED);
+
+    for (off = start;  off < size;  )
+    {
+        __u64 chunk = (off / pagesize) % hdr->data_pages;
+        size_t pgoff = off % pagesize;
+        size_t n = pagesize - pgoff;
+        if (n > size - off)
+            n = size - off;
+        fwrite(p + pagesize * (1 + chunk) + pgoff, 1, n, stdout);
+        off += n;
+    }
+
+    /* in ring mode, data may have been overwritten while we were copying it */
+    if (__atomic_load_n(&hdr->data_start, __ATOMIC_ACQUIRE) > start)
+        fprintf(stderr, "warning: oldest data was overwritten during the dump\n");
+
+    munmap(p, maplen);
+    return 0;
+}
+
+/*
+ * Issue count print commands with a single IOC_MYTEST_BATCH call
+ */
+static int
+print_batch(const char* text, int count)
+{
+    struct mytest_batch_entry* ents;
+    struct mytest_batch batch;
+    int error = 0;
+    int fd;
+    int k;
+
+    if (count <= 0 || count > MYTEST_BATCH_MAX)
+    {
+        fprintf(stderr, "count must be 1 to %d\n", MYTEST_BATCH_MAX);
+        return EINVAL;
+    }
+
+    ents = calloc(count, sizeof(*ents));
+    if (ents == NULL)
+        return ENOMEM;
+
+    for (k = 0;  k < count;  k++)
+    {
+        ents[k].cmd = IOC_MYTEST_PRINT;
+        ents[k].len = strlen(text);
+        ents[k].payload = (__u64) (unsigned long) text;
+    }
+
+    batch.entries = (__u64) (unsigned long) ents;
+    batch.count = count;
+    batch.flags = 0;
+
+    fd = open_device(O_WRONLY);
+    if (ioctl(fd, IOC_MYTEST_BATCH, &batch))
+    {
+        error = errno;
+        perror("ioctl");
+    }
+    else
+    {
+        for (k = 0;  k < count;  k++)
+        {
+            if (ents[k].status)
+                fprintf(stderr, "entry %d: %s\n", k, strerror(-ents[k].status));
+        }
+    }
+
+    close(fd);
+    free(ents);
+    return error;
+}
+
+/*
+ * Print offsets of all matches of pattern (or of lines containing it),
+ * found by the kernel
+ */
+static int
+search(const char* pattern, int lines)
+{
+    __u64 matches[1024];
+    struct mytest_search sr;
+    int error = 0;
+    int fd;
+    __u32 k;
+
+    memset(&sr, 0, sizeof(sr));
+    sr.pattern = (__u64) (unsigned long) pattern;
+    sr.pattern_len = strlen(pattern);
+    sr.flags = lines ? MYTEST_SEARCH_LINES : 0;
+    sr.matches = (__u64) (unsigned long) matches;
+    sr.max_matches = sizeof(matches) / sizeof(matches[0]);
+
+    fd = open_device(O_RDONLY);
+
+    for (;;)
+    {
+        sr.end = 0;
+        if (ioctl(fd, IOC_MYTEST_SEARCH, &sr))
+        {
+            error = errno;
+            perror("ioctl");
+            break;
+        }
+
+        for (k = 0;  k < sr.nmatches;  k++)
+            printf("%llu\n", (unsigned long long) matches[k]);
+
+        if (sr.resume >= sr.end)
+            break;
+        sr.start = sr.resume;
+    }
+
+    close(fd);
+    return error;
+}
+
+/*
+ * Benchmarks (build with -pthread).
+ *
+ * Latencies are collected in log-linear histograms, 16 sub-buckets per power
+ * of two, so percentiles are within about 6%. Results are printed as CSV,
+ * one line per operation type:
+ *
+ *     test,op,threads,record_size,ops,seconds,ops_per_s,mb_per_s,p50_ns,p99_ns,p999_ns
+ */
+#define HIST_SUB_BITS   4
+#define HIST_BUCKETS    (40 << HIST_SUB_BITS)
+
+struct hist
+{
+    unsigned long long count;
+    unsigned long long bytes;
+    unsigned long long b[HIST_BUCKETS];
+};
+
+struct bench_thread
+{
+    pthread_t tid;
+    int fd;
+    size_t record_size;
+    int iterations;
+    int error;
+    struct hist h;
+};
+
+static int bench_stop;
+static int poll_ready;                 /* 1: poller about to poll, -1: poller gone */
+static unsigned long long poll_t0;
+
+static int bench_rw(int writers, int readers, size_t record_size, int seconds);
+static int bench_poll(int iterations);
+static int bench_ioctl(int iterations);
+static int bench_path(int iterations);
+static void* bench_writer(void* arg);
+static void* bench_reader(void* arg);
+static void* bench_poller(void* arg);
+static void bench_ring(int fd);
+static int drain(int fd, char* buf, size_t size);
+static unsigned long long now_ns(void);
+static unsigned int hist_bucket(unsigned long long ns);
+static unsigned long long hist_bucket_floor(unsigned int k);
+static void hist_add(struct hist* h, unsigned long long ns);
+static void hist_merge(struct hist* to, const struct hist* from);
+static unsigned long long hist_percentile(const struct hist* h, double q);
+static void print_csv(const char* test, const char* op, int threads, size_t record_size,
+                      const struct hist* h, double seconds);
+
+static int
+bench(int argc, char** argv)
+{
+    if (0 == strcmp(argv[0], "rw") && argc == 5)
+        return bench_rw(atoi(argv[1]), atoi(argv[2]), strtoul(argv[3], NULL, 0), atoi(argv[4]));
+    if (0 == strcmp(argv[0], "poll") && argc == 2)
+        return bench_poll(atoi(argv[1]));
+    if (0 == strcmp(argv[0], "ioctl") && argc == 2)
+        return bench_ioctl(atoi(argv[1]));
+    if (0 == strcmp(argv[0], "path") && argc == 2)
+        return bench_path(atoi(argv[1]));
+
+    fprintf(stderr, "unknown bench\n");
+    return EINVAL;
+}
+
+/*
+ * writers threads append records of record_size bytes, readers threads
+ * follow the data with poll() and read(), for the given number of seconds.
+ * The device is switched to ring mode, so that it does not fill up, and
+ * left that way.
+ */
+static int
+bench_rw(int writers, int readers, size_t record_size, int seconds)
+{
+    struct bench_thread* th;
+    struct hist wh;
+    struct hist rh;
+    unsigned long long t0;
+    double elapsed;
+    int error = 0;
+    int fd;
+    int k;
+
+    if (writers < 1 || readers < 0 || record_size == 0 || seconds <= 0)
+    {
+        fprintf(stderr, "need at least 1 writer, a record size and a duration\n");
+        return EINVAL;
+    }
+
+    fd = open_device(O_WRONLY);
+    bench_ring(fd);
+    close(fd);
+
+    th = calloc(writers + readers, sizeof(*th));
+    if (th == NULL)
+        return ENOMEM;
+
+    __atomic_store_n(&bench_stop, 0, __ATOMIC_RELAXED);
+    t0 = now_ns();
+
+    for (k = 0;  k < writers + readers;  k++)
+    {
+        th[k].record_size = record_size;
+        th[k].fd = open_device(k < writers ? O_WRONLY : O_RDONLY | O_NONBLOCK);
+        if (pthread_create(&th[k].tid, NULL, k < writers ? bench_writer : bench_reader, &th[k]))
+        {
+            fprintf(stderr, "unable to create thread\n");
+            exit(ENOMEM);
+        }
+    }
+
+    sleep(seconds);
+    __atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+
+    memset(&wh, 0, sizeof(wh));
+    memset(&rh, 0, sizeof(rh));
+    for (k = 0;  k < writers + readers;  k++)
+    {
+        pthread_join(th[k].tid, NULL);
+        close(th[k].fd);
+        hist_merge(k < writers ? &wh : &rh, &th[k].h);
+        if (th[k].error && !error)
+            error = th[k].error;
+    }
+    elapsed = (now_ns() - t0) / 1e9;
+
+    printf("test,op,threads,record_size,ops,seconds,ops_per_s,mb_per_s,p50_ns,p99_ns,p999_ns\n");
+    print_csv("rw", "write", writers, record_size, &wh, elapsed);
+    if (readers)
+        print_csv("rw", "read", readers, record_size, &rh, elapsed);
+
+    free(th);
+    return error;
+}
+
+static void*
+bench_writer(void* arg)
+{
+    struct bench_thread* t = (struct bench_thread*) arg;
+    char* rec = malloc(t->record_size);
+
+    if (rec == NULL)
+    {
+        t->error = ENOMEM;
+        return NULL;
+    }
+    memset(rec, 'x', t->record_size);
+    rec[t->record_size - 1] = '\n';
+
+    while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED))
+    {
+        unsigned long long t0 = now_ns();
+        ssize_t n = write(t->fd, rec, t->record_size);
+        unsigned long long t1 = now_ns();
+
+        if (n <= 0)
+        {
+            t->error = n < 0 ? errno : ENOSPC;
+            fprintf(stderr, "write: %s\n", strerror(t->error));
+            break;
+        }
+
+        hist_add(&t->h, t1 - t0);
+        t->h.bytes += n;
+    }
+
+    free(rec);
+    return NULL;
+}
+
+/* only reads that return data are counted */
+static void*
+bench_reader(void* arg)
+{
+    struct bench_thread* t = (struct bench_thread*) arg;
+    size_t size = 64 * 1024;
+    char* buf = malloc(size);
+    struct pollfd pfd;
+
+    if (buf == NULL)
+    {
+        t->error = ENOMEM;
+        return NULL;
+    }
+
+    /* follow new data only */
+    lseek(t->fd, 0, SEEK_END);
+
+    pfd.fd = t->fd;
+    pfd.events = POLLIN;
+
+    while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED))
+    {
+        unsigned long long t0;
+        unsigned long long t1;
+        ssize_t n;
+
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        t0 = now_ns();
+        n = read(t->fd, buf, size);
+        t1 = now_ns();
+
+        if (n < 0 && errno != EAGAIN)
+        {
+            t->error = errno;
+            fprintf(stderr, "read: %s\n", strerror(t->error));
+            break;
+        }
+        if (n <= 0)
+            continue;
+
+        hist_add(&t->h, t1 - t0);
+        t->h.bytes += n;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Time from the start of a write() until a reader blocked in poll() on the
+ * same device gets to run.
+ */
+static int
+bench_poll(int iterations)
+{
+    struct bench_thread poller;
+    char rec[16];
+    int error = 0;
+    int fd;
+    int k;
+
+    if (iterations <= 0)
+        return EINVAL;
+
+    memset(rec, 'p', sizeof(rec));
+    rec[sizeof(rec) - 1] = '\n';
+
+    memset(&poller, 0, sizeof(poller));
+    poller.iterations = iterations;
+    poller.fd = open_device(O_RDONLY | O_NONBLOCK);
+    fd = open_device(O_WRONLY);
+
+    __atomic_store_n(&poll_ready, 0, __ATOMIC_RELAXED);
+    if (pthread_create(&poller.tid, NULL, bench_poller, &poller))
+    {
+        fprintf(stderr, "unable to create thread\n");
+        return ENOMEM;
+    }
+
+    for (k = 0;  k < iterations;  k++)
+    {
+        struct timespec ts = { 0, 1000 * 1000 };
+        int ready = 1;
+
+        /* wait for the poller to come back, then give it time to block */
+        while (__atomic_load_n(&poll_ready, __ATOMIC_ACQUIRE) == 0)
+            sched_yield();
+        nanosleep(&ts, NULL);
+        if (!__atomic_compare_exchange_n(&poll_ready, &ready, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+
+        __atomic_store_n(&poll_t0, now_ns(), __ATOMIC_RELEASE);
+        if (write(fd, rec, sizeof(rec)) != sizeof(rec))
+        {
+            error = errno ? errno : ENOSPC;
+            perror("write");
+            break;
+        }
+    }
+
+    if (error)
+        pthread_cancel(poller.tid);
+    pthread_join(poller.tid, NULL);
+    if (poller.error && !error)
+        error = poller.error;
+    close(poller.fd);
+    close(fd);
+
+    if (error == 0)
+    {
+        printf("test,op,threads,record_size,ops,seconds,ops_per_s,mb_per_s,p50_ns,p99_ns,p999_ns\n");
+        print_csv("poll", "wakeup", 1, sizeof(rec), &poller.h, 0);
+    }
+
+    return error;
+}
+
+static void*
+bench_poller(void* arg)
+{
+    struct bench_thread* t = (struct bench_thread*) arg;
+    char buf[4096];
+    struct pollfd pfd;
+    unsigned long long t0;
+    unsigned long long t1;
+    int k;
+
+    pfd.fd = t->fd;
+    pfd.events = POLLIN;
+
+    for (k = 0;  k < t->iterations;  k++)
+    {
+        if (drain(t->fd, buf, sizeof(buf)))
+        {
+            t->error = errno;
+            break;
+        }
+
+        __atomic_store_n(&poll_ready, 1, __ATOMIC_RELEASE);
+
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            t->error = errno;
+            perror("poll");
+            break;
+        }
+
+        t0 = __atomic_load_n(&poll_t0, __ATOMIC_ACQUIRE);
+        t1 = now_ns();
+        if (t1 >= t0)
+            hist_add(&t->h, t1 - t0);
+    }
+
+    __atomic_store_n(&poll_ready, -1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Benchmarks that write a lot switch the device to ring mode so it does not
+ * fill up. There is no way to read the mode back, so it is not restored.
+ */
+static void
+bench_ring(int fd)
+{
+    int ring = 1;
+
+    if (ioctl(fd, IOC_MYTEST_SET_RING, &ring))
+        perror("warning: unable to switch to ring mode");
+    else
+        fprintf(stderr, "note: device switched to ring mode, 'test ring 0' switches it back\n");
+}
+
+/* read everything there is, works whether reads at the end block or not */
+static int
+drain(int fd, char* buf, size_t size)
+{
+    ssize_t n;
+
+    while ((n = read(fd, buf, size)) > 0)
+        ;
+
+    if (n < 0 && errno != EAGAIN)
+    {
+        perror("read");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Round-trip time of a trivial ioctl
+ */
+static int
+bench_ioctl(int iterations)
+{
+    struct hist* h = calloc(1, sizeof(*h));
+    unsigned long long t0;
+    __u64 lost;
+    int error = 0;
+    int fd;
+    int k;
+
+    if (h == NULL)
+        return ENOMEM;
+
+    fd = open_device(O_RDONLY);
+    t0 = now_ns();
+
+    for (k = 0;  k < iterations;  k++)
+    {
+        unsigned long long t1 = now_ns();
+        if (ioctl(fd, IOC_MYTEST_GET_LOST, &lost))
+        {
+            error = errno;
+            perror("ioctl");
+            break;
+        }
+        hist_add(h, now_ns() - t1);
+    }
+
+    if (error == 0)
+    {
+        printf("test,op,threads,record_size,ops,seconds,ops_per_s,mb_per_s,p50_ns,p99_ns,p999_ns\n");
+        print_csv("ioctl", "get_lost", 1, 0, h, (now_ns() - t0) / 1e9);
+    }
+
+    close(fd);
+    free(h);
+    return error;
+}
+
+/*
+ * Cost of a single write() and of reading it back, for several record sizes,
+ * one thread, no contention. seconds is the time spent in the calls only,
+ * so ops_per_s is 1e9 / average ns per call. Meant for comparing data path
+ * changes, run it on an idle device pinned to one CPU (e.g. taskset -c 2).
+ */
+static int
+bench_path(int iterations)
+{
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+    static char buf[65536];
+    struct hist* wh = calloc(1, sizeof(*wh));
+    struct hist* rh = calloc(1, sizeof(*rh));
+    int error = 0;
+    int wfd;
+    int rfd;
+    int k;
+    size_t i;
+
+    if (wh == NULL || rh == NULL || iterations <= 0)
+        return iterations <= 0 ? EINVAL : ENOMEM;
+
+    wfd = open_device(O_WRONLY);
+    rfd = open_device(O_RDONLY | O_NONBLOCK);
+    bench_ring(wfd);
+    memset(buf, 'b', sizeof(buf));
+
+    printf("test,op,threads,record_size,ops,seconds,ops_per_s,mb_per_s,p50_ns,p99_ns,p999_ns\n");
+
+    for (i = 0;  i < sizeof(sizes) / sizeof(sizes[0]) && !error;  i++)
+    {
+        unsigned long long wns = 0;
+        unsigned long long rns = 0;
+
+        memset(wh, 0, sizeof(*wh));
+        memset(rh, 0, sizeof(*rh));
+        lseek(rfd, 0, SEEK_END);
+
+        for (k = 0;  k < iterations;  k++)
+        {
+            unsigned long long t0 = now_ns();
+            ssize_t n = write(wfd, buf, sizes[i]);
+            unsigned long long t1 = now_ns();
+            unsigned long long t2;
+
+            if (n != (ssize_t) sizes[i])
+            {
+                error = n < 0 ? errno : ENOSPC;
+                perror("write");
+                break;
+            }
+
+            n = read(rfd, buf, sizes[i]);
+            t2 = now_ns();
+            if (n != (ssize_t) sizes[i])
+            {
+                error = n < 0 ? errno : EIO;
+                perror("read");
+                break;
+            }
+
+            hist_add(wh, t1 - t0);
+            hist_add(rh, t2 - t1);
+            wh->bytes += sizes[i];
+            rh->bytes += sizes[i];
+            wns += t1 - t0;
+            rns += t2 - t1;
+        }
+
+        if (error == 0)
+        {
+            print_csv("path", "write", 1, sizes[i], wh, wns / 1e9);
+            print_csv("path", "read", 1, sizes[i], rh, rns / 1e9);
+        }
+    }
+
+    close(wfd);
+    close(rfd);
+    free(wh);
+    free(rh);
+    return error;
+}
+
+static unsigned long long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned int
+hist_bucket(unsigned long long ns)
+{
+    unsigned int e;
+    unsigned int k;
+
+    if (ns < (1 << HIST_SUB_BITS))
+        return ns;
+
+    e = 63 - __builtin_clzll(ns);
+    k = ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((ns >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    return k < HIST_BUCKETS ? k : HIST_BUCKETS - 1;
+}
+
+/* smallest value falling into bucket k */
+static unsigned long long
+hist_bucket_floor(unsigned int k)
+{
+    unsigned int e;
+
+    if (k < (1 << HIST_SUB_BITS))
+        return k;
+
+    e = (k >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return (unsigned long long) ((1 << HIST_SUB_BITS) + (k & ((1 << HIST_SUB_BITS) - 1))) << (e - HIST_SUB_BITS);
+}
+
+static void
+hist_add(struct hist* h, unsigned long long ns)
+{
+    h->b[hist_bucket(ns)]++;
+    h->count++;
+}
+
+static void
+hist_merge(struct hist* to, const struct hist* from)
+{
+    int k;
+
+    for (k = 0;  k < HIST_BUCKETS;  k++)
+        to->b[k] += from->b[k];
+    to->count += from->count;
+    to->bytes += from->bytes;
+}
+
+/* upper bound of the bucket holding the q-th quantile */
+static unsigned long long
+hist_percentile(const struct hist* h, double q)
+{
+    unsigned long long want = (unsigned long long) (h->count * q);
+    unsigned long long seen = 0;
+    unsigned int k;
+
+    if (want == 0)
+        want = 1;
+
+    for (k = 0;  k < HIST_BUCKETS;  k++)
+    {
+        seen += h->b[k];
+        if (seen >= want)
+            return hist_bucket_floor(k + 1 < HIST_BUCKETS ? k + 1 : k);
+    }
+
+    return 0;
+}
+
+/* seconds == 0: throughput is not meaningful for the test */
+static void
+print_csv(const char* test, const char* op, int threads, size_t record_size,
+          const struct hist* h, double seconds)
+{
+    printf("%s,%s,%d,%zu,%llu,%.3f,%.0f,%.2f,%llu,%llu,%llu\n",
+           test, op, threads, record_size, h->count, seconds,
+           seconds > 0 ? h->count / seconds : 0.0,
+           seconds > 0 ? h->bytes / seconds / 1e6 : 0.0,
+           hist_percentile(h, 0.50), hist_percentile(h, 0.99), hist_percentile(h, 0.999));
+}
+
+/*
+ * Print the CPU x CPU cross call latency matrix (row = sending CPU), then
+ * the cost of calling n CPUs at once and the stop_machine() stall, as CSV
+ */
+static int
+ipi_bench(int iterations)
+{
+    struct mytest_ipi_bench b;
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    __u64* matrix = calloc(ncpus * ncpus, sizeof(__u64));
+    __u64* broadcast = calloc(ncpus, sizeof(__u64));
+    int error = 0;
+    int fd;
+    long i;
+    long j;
+
+    if (matrix == NULL || broadcast == NULL)
+        return ENOMEM;
+
+    memset(&b, 0, sizeof(b));
+    b.ncpus = ncpus;
+    b.iterations = iterations;
+    b.matrix = (__u64) (unsigned long) matrix;
+    b.broadcast = (__u64) (unsigned long) broadcast;
+
+    fd = open_device(O_RDONLY);
+    if (ioctl(fd, IOC_MYTEST_IPI_BENCH, &b))
+    {
+        error = errno;
+        perror("ioctl");
+    }
+    else
+    {
+        printf("from/to");
+        for (j = 0;  j < ncpus;  j++)
+            printf(",%ld", j);
+        printf("\n");
+        for (i = 0;  i < ncpus;  i++)
+        {
+            printf("%ld", i);
+            for (j = 0;  j < ncpus;  j++)
+                printf(",%llu", (unsigned long long) matrix[i * ncpus + j]);
+            printf("\n");
+        }
+
+        printf("\nbroadcast_cpus,ns\n");
+        for (i = 1;  i < ncpus && broadcast[i];  i++)
+            printf("%ld,%llu\n", i, (unsigned long long) broadcast[i]);
+
+        printf("\nstop_machine_ns,stop_machine_max_ns\n%llu,%llu\n",
+               (unsigned long long) b.stop_machine_ns, (unsigned long long) b.stop_machine_max_ns);
+    }
+
+    close(fd);
+    free(matrix);
+    free(broadcast);
+    return error;
+}
+
+/*
+ * Poll for new data with the given wakeup thresholds, print how much each
+ * wakeup brought. Runs until interrupted.
+ */
+static int
+follow(unsigned int min_bytes, unsigned int max_delay_us, int exclusive)
+{
+    struct mytest_wakeup w;
+    struct pollfd pfd;
+    unsigned long long t0 = now_ns();
+    char buf[65536];
+    ssize_t n;
+    size_t got;
+
+    memset(&w, 0, sizeof(w));
+    w.min_bytes = min_bytes;
+    w.max_delay_us = max_delay_us;
+    w.flags = exclusive ? MYTEST_WAKEUP_EXCLUSIVE : 0;
+
+    pfd.fd = open_device(O_RDONLY | O_NONBLOCK);
+    pfd.events = POLLIN;
+
+    if (ioctl(pfd.fd, IOC_MYTEST_SET_WAKEUP, &w))
+    {
+        perror("ioctl");
+        return errno;
+    }
+
+    for (;;)
+    {
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            perror("poll");
+            return errno;
+        }
+
+        got = 0;
+        while ((n = read(pfd.fd, buf, sizeof(buf))) > 0)
+            got += n;
+        if (n < 0 && errno != EAGAIN)
+        {
+            perror("read");
+            return errno;
+        }
+
+        printf("%.6f: %zu bytes\n", (now_ns() - t0) / 1e9, got);
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
+/*
+ * Join (creating if needed) a consumer group and copy whatever the group
+ * has not read yet to stdout. Run again to continue where it left off.
+ */
+static int
+group_read(const char* name)
+{
+    struct mytest_group g;
+    char buf[65536];
+    ssize_t n;
+    int fd;
+
+    memset(&g, 0, sizeof(g));
+    strncpy(g.name, name, sizeof(g.name) - 1);
+    g.flags = MYTEST_GROUP_CREATE;
+
+    fd = open_device(O_RDONLY | O_NONBLOCK);
+    if (ioctl(fd, IOC_MYTEST_JOIN_GROUP, &g))
+    {
+        perror("ioctl");
+        return errno;
+    }
+    fprintf(stderr, "group %s: cursor %llu\n", g.name, (unsigned long long) g.cursor);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        if (fwrite(buf, 1, n, stdout) != (size_t) n)
+            return EIO;
+    }
+    if (n < 0 && errno != EAGAIN)
+    {
+        perror("read");
+        return errno;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int
+group_delete(const char* name)
+{
+    struct mytest_group g;
+    int fd;
+
+    memset(&g, 0, sizeof(g));
+    strncpy(g.name, name, sizeof(g.name) - 1);
+
+    fd = open_device(O_RDONLY);
+    if (ioctl(fd, IOC_MYTEST_DELETE_GROUP, &g))
+    {
+        perror("ioctl");
+        return errno;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Print the records of a device in framed mode, one per line, starting with
+ * the oldest or at the given sequence number or time (CLOCK_REALTIME ns).
+ */
+static int
+print_records(const char* whence, const char* value)
+{
+    struct mytest_seek sk;
+    static char buf[1024 * 1024];
+    ssize_t n;
+    size_t k;
+    int fd;
+
+    fd = open_device(O_RDONLY | O_NONBLOCK);
+
+    if (whence)
+    {
+        memset(&sk, 0, sizeof(sk));
+        sk.whence = (0 == strcmp(whence, "time")) ? MYTEST_SEEK_TIME : MYTEST_SEEK_SEQ;
+        sk.value = strtoull(value, NULL, 0);
+        if (ioctl(fd, IOC_MYTEST_SEEK, &sk))
+        {
+            perror("ioctl");
+            return errno;
+        }
+        fprintf(stderr, "offset %llu, seq %llu\n", (unsigned long long) sk.offset, (unsigned long long) sk.seq);
+    }
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (k = 0;  k < (size_t) n;  k += MYTEST_RECORD_SIZE(((struct mytest_record*) (buf + k))->len))
+        {
+            const struct mytest_record* r = (const struct mytest_record*) (buf + k);
+
+            printf("%llu %llu.%09llu %u: %.*s\n", (unsigned long long) r->seq,
+                   (unsigned long long) r->time_ns / 1000000000, (unsigned long long) r->time_ns % 1000000000,
+                   r->len, (int) r->len, (const char*) (r + 1));
+        }
+    }
+    if (n < 0 && errno != EAGAIN)
+    {
+        perror("read");
+        return errno;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Self-check of read/write/seek/poll semantics and of concurrent writers and
+ * readers, on whatever device MYTEST_DEVICE names. Switches the device to
+ * ring mode, so that it does not fill up, and only looks at data written
+ * after it started. Other writers on the device make it fail. Prints every
+ * failed check, returns non-zero if any failed.
+ */
+
+#define CHECK_WRITERS   4
+#define CHECK_READERS   2
+#define CHECK_RECORDS   20000
+#define CHECK_RECSIZE   64
+#define CHECK_BIGSIZE   (32 * 1024)     /* more than a kernel staging buffer */
+
+#define CHECK(cond)     check_report((cond) != 0, #cond, __LINE__)
+
+struct check_reader
+{
+    pthread_t tid;
+    int fd;
+    unsigned long long seen;
+    unsigned long long lost;
+    int failed;
+};
+
+static int check_count;
+static int check_failed;
+static int check_stop;
+
+static void check_report(int ok, const char* what, int line);
+static void check_concurrent(void);
+static void* check_writer(void* arg);
+static void* check_reader(void* arg);
+
+static int
+check(void)
+{
+    struct pollfd pfd;
+    struct iovec iov[3];
+    cpu_set_t cpus;
+    cpu_set_t oldcpus;
+    char buf[256];
+    char* big;
+    off_t base;
+    int ring = 1;
+    int staging;
+    __u32 timeout_ms = 50;
+    unsigned long long t0;
+    int wfd;
+    int rfd;
+    int bfd;
+
+    wfd = open_device(O_WRONLY);
+    rfd = open_device(O_RDONLY | O_NONBLOCK);
+    CHECK(ioctl(wfd, IOC_MYTEST_SET_RING, &ring) == 0);
+
+    /* nothing new to read yet */
+    base = lseek(rfd, 0, SEEK_END);
+    CHECK(base >= 0);
+    pfd.fd = rfd;
+    pfd.events = POLLIN;
+    CHECK(poll(&pfd, 1, 0) == 0);
+    CHECK(read(rfd, buf, sizeof(buf)) < 0 && errno == EAGAIN);
+
+    /* a blocking read at the end waits, here until its timeout */
+    bfd = open_device(O_RDONLY);
+    CHECK(lseek(bfd, 0, SEEK_END) == base);
+    CHECK(ioctl(bfd, IOC_MYTEST_SET_READ_TIMEOUT, &timeout_ms) == 0);
+    t0 = now_ns();
+    CHECK(read(bfd, buf, sizeof(buf)) < 0 && errno == ETIMEDOUT);
+    CHECK(now_ns() - t0 >= timeout_ms * 1000000ull);
+
+    /* a write shows up whole, in order, and wakes up poll */
+    CHECK(write(wfd, "hello", 5) == 5);
+    CHECK(poll(&pfd, 1, 1000) == 1 && (pfd.revents & POLLIN));
+    CHECK(read(rfd, buf, sizeof(buf)) == 5 && 0 == memcmp(buf, "hello", 5));
+    CHECK(lseek(rfd, 0, SEEK_CUR) == base + 5);
+    CHECK(read(bfd, buf, sizeof(buf)) == 5 && 0 == memcmp(buf, "hello", 5));
+    close(bfd);
+
+    /* seeks within the data, and outside of it */
+    CHECK(lseek(rfd, base, SEEK_SET) == base);
+    CHECK(read(rfd, buf, 2) == 2 && 0 == memcmp(buf, "he", 2));
+    CHECK(lseek(rfd, 1, SEEK_CUR) == base + 3);
+    CHECK(read(rfd, buf, sizeof(buf)) == 2 && 0 == memcmp(buf, "lo", 2));
+    CHECK(lseek(rfd, -5, SEEK_END) == base);
+    CHECK(lseek(rfd, 1, SEEK_END) < 0 && errno == EINVAL);
+    CHECK(lseek(rfd, -1, SEEK_SET) < 0 && errno == EINVAL);
+    CHECK(pread(rfd, buf, 3, base + 1) == 3 && 0 == memcmp(buf, "ell", 3));
+
+    /* a vectored write is appended in one piece */
+    iov[0].iov_base = "ab";
+    iov[0].iov_len = 2;
+    iov[1].iov_base = "";
+    iov[1].iov_len = 0;
+    iov[2].iov_base = "cde";
+    iov[2].iov_len = 3;
+    CHECK(writev(wfd, iov, 3) == 5);
+    CHECK(pread(rfd, buf, sizeof(buf), base + 5) == 5 && 0 == memcmp(buf, "abcde", 5));
+
+    /* zero-length I/O changes nothing */
+    CHECK(write(wfd, buf, 0) == 0);
+    CHECK(lseek(rfd, 0, SEEK_END) == base + 10);
+    CHECK(read(rfd, buf, 0) == 0);
+
+    /* a ring never refuses writes */
+    pfd.fd = wfd;
+    pfd.events = POLLOUT;
+    CHECK(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT));
+
+    /* with staging, a write too large to be staged stays behind one staged earlier on the same CPU */
+    big = malloc(CHECK_BIGSIZE);
+    memset(big, 'B', CHECK_BIGSIZE);
+    CHECK(sched_getaffinity(0, sizeof(oldcpus), &oldcpus) == 0);
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    CHECK(sched_setaffinity(0, sizeof(cpus), &cpus) == 0);
+    staging = 1;
+    CHECK(ioctl(wfd, IOC_MYTEST_SET_STAGING, &staging) == 0);
+    CHECK(write(wfd, "small", 5) == 5);
+    CHECK(write(wfd, big, CHECK_BIGSIZE) == CHECK_BIGSIZE);
+    staging = 0;
+    CHECK(ioctl(wfd, IOC_MYTEST_SET_STAGING, &staging) == 0);
+    CHECK(sched_setaffinity(0, sizeof(oldcpus), &oldcpus) == 0);
+    CHECK(lseek(rfd, 0, SEEK_END) == base + 15 + CHECK_BIGSIZE);
+    CHECK(pread(rfd, buf, 6, base + 10) == 6 && 0 == memcmp(buf, "smallB", 6));
+    CHECK(pread(rfd, buf, 1, base + 14 + CHECK_BIGSIZE) == 1 && buf[0] == 'B');
+    free(big);
+
+    close(wfd);
+    close(rfd);
+
+    check_concurrent();
+
+    printf("%d checks, %d failed\n", check_count, check_failed);
+    return check_failed ? EIO : 0;
+}
+
+static void
+check_report(int ok, const char* what, int line)
+{
+    /* writer threads report too */
+    __atomic_add_fetch(&check_count, 1, __ATOMIC_RELAXED);
+    if (ok)
+        return;
+    __atomic_add_fetch(&check_failed, 1, __ATOMIC_RELAXED);
+    printf("FAIL line %d: %s (errno %d)\n", line, what, errno);
+}
+
+/*
+ * Writers append fixed-size records "wid seq", readers check that each
+ * writer's records arrive whole and in order. Records can only go missing
+ * where a reader reports lost bytes, i.e. when it fell a whole ring behind.
+ */
+static void
+check_concurrent(void)
+{
+    struct check_reader readers[CHECK_READERS];
+    pthread_t writers[CHECK_WRITERS];
+    long k;
+
+    __atomic_store_n(&check_stop, 0, __ATOMIC_RELAXED);
+
+    for (k = 0;  k < CHECK_READERS;  k++)
+    {
+        memset(&readers[k], 0, sizeof(readers[k]));
+        readers[k].fd = open_device(O_RDONLY | O_NONBLOCK);
+        lseek(readers[k].fd, 0, SEEK_END);
+        if (pthread_create(&readers[k].tid, NULL, check_reader, &readers[k]))
+            exit(ENOMEM);
+    }
+
+    for (k = 0;  k < CHECK_WRITERS;  k++)
+    {
+        if (pthread_create(&writers[k], NULL, check_writer, (void*) k))
+            exit(ENOMEM);
+    }
+
+    for (k = 0;  k < CHECK_WRITERS;  k++)
+        pthread_join(writers[k], NULL);
+    __atomic_store_n(&check_stop, 1, __ATOMIC_RELEASE);
+
+    for (k = 0;  k < CHECK_READERS;  k++)
+    {
+        pthread_join(readers[k].tid, NULL);
+        close(readers[k].fd);
+        CHECK(readers[k].failed == 0);
+        CHECK(readers[k].seen * CHECK_RECSIZE + readers[k].lost == (unsigned long long) CHECK_WRITERS * CHECK_RECORDS * CHECK_RECSIZE);
+    }
+}
+
+static void*
+check_writer(void* arg)
+{
+    long wid = (long) arg;
+    char rec[CHECK_RECSIZE + 1];
+    int fd = open_device(O_WRONLY);
+    int seq;
+
+    for (seq = 0;  seq < CHECK_RECORDS;  seq++)
+    {
+        int n = snprintf(rec, sizeof(rec), "%ld %d ", wid, seq);
+        memset(rec + n, '.', CHECK_RECSIZE - n);
+        rec[CHECK_RECSIZE - 1] = '\n';
+        if (write(fd, rec, CHECK_RECSIZE) != CHECK_RECSIZE)
+        {
+            CHECK(!"writer: short write");
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void*
+check_reader(void* arg)
+{
+    struct check_reader* r = (struct check_reader*) arg;
+    static __thread char buf[CHECK_RECSIZE * 256];
+    int next[CHECK_WRITERS];
+    struct pollfd pfd;
+    __u64 lost;
+    int stopping;
+    ssize_t n;
+    ssize_t k;
+
+    memset(next, 0, sizeof(next));
+    pfd.fd = r->fd;
+    pfd.events = POLLIN;
+
+    for (;;)
+    {
+        /* stop only after a read that came after the writers were done */
+        stopping = __atomic_load_n(&check_stop, __ATOMIC_ACQUIRE);
+
+        n = read(r->fd, buf, sizeof(buf));
+        if (n < 0 && errno != EAGAIN)
+        {
+            r->failed++;
+            break;
+        }
+        if (n <= 0)
+        {
+            if (stopping)
+                break;
+            poll(&pfd, 1, 100);
+            continue;
+        }
+
+        if (ioctl(r->fd, IOC_MYTEST_GET_LOST, &lost) == 0)
+            r->lost += lost;
+
+        if (n % CHECK_RECSIZE)
+            r->failed++;
+
+        for (k = 0;  k + CHECK_RECSIZE <= n;  k += CHECK_RECSIZE)
+        {
+            int wid;
+            int seq;
+
+            if (sscanf(buf + k, "%d %d ", &wid, &seq) != 2 || wid < 0 || wid >= CHECK_WRITERS ||
+                buf[k + CHECK_RECSIZE - 1] != '\n' || seq < next[wid] || (seq != next[wid] && r->lost == 0))
+            {
+                r->failed++;
+                continue;
+            }
+            next[wid] = seq + 1;
+            r->seen++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Copy new data to stdout as it arrives, like tail -f, with blocking reads
+ * only. With a timeout, print a note whenever nothing came for that long.
+ */
+static int
+tail(unsigned int timeout_ms)
+{
+    __u32 ms = timeout_ms;
+    char buf[65536];
+    ssize_t n;
+    int fd;
+
+    fd = open_device(O_RDONLY);
+    lseek(fd, 0, SEEK_END);
+    if (ioctl(fd, IOC_MYTEST_SET_READ_TIMEOUT, &ms))
+    {
+        perror("ioctl");
+        return errno;
+    }
+
+    for (;;)
+    {
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == ETIMEDOUT)
+        {
+            fprintf(stderr, "no data for %u ms\n", timeout_ms);
+            continue;
+        }
+        if (n < 0)
+        {
+            perror("read");
+            return errno;
+        }
+        if (n == 0)
+            break;
+        if (fwrite(buf, 1, n, stdout) != (size_t) n)
+            return EIO;
+        fflush(stdout);
+    }
+
+    /* the device was destroyed */
+    close(fd);
+    return 0;
+}